@@ -0,0 +1,235 @@
+// headless benchmarks, `make bench` builds and runs them
+// kilo.c gets compiled right into this file so everything in it can be
+// reached, keys are fed straight into its input buffer and frames are
+// drawn into an abuf instead of the terminal
+
+#define KILO_NO_MAIN
+#include "kilo.c"
+
+#include <sys/wait.h>
+
+/*** generated files ***/
+
+static void genC(FILE *fp, int lines) {
+	// something that looks like C: nesting, comments, strings, numbers
+	static const char *body[] = {
+		"\tint count = %d; // how many there are",
+		"\tif (count > 0x%x && flags & (1 << 3)) {",
+		"\t\tchar *name = \"entry %d\";",
+		"\t\treturn lookup(table, name, %d.5f);",
+		"\t}",
+		"\t/* a comment that runs over",
+		"\t   a couple of lines, %d of them */",
+		"\tfor (unsigned int i = 0; i < %d; i++) total += values[i];",
+		"\twhile (node != NULL && node->key != '%c') node = node->next;",
+		"\tstruct entry *e = &entries[%d];",
+	};
+	int n = sizeof(body) / sizeof(body[0]);
+	for (int i = 0; i < lines; i++) {
+		if (i % 40 == 0) {
+			fprintf(fp, "static int function_%d(struct table *table, int flags) {\n", i);
+		} else if (i % 40 == 39) {
+			fputs("}\n", fp);
+		} else {
+			const char *fmt = body[i % n];
+			fprintf(fp, fmt, strstr(fmt, "%c") ? 'a' + i % 26 : i);
+			fputc('\n', fp);
+		}
+	}
+}
+
+static void genJSON(FILE *fp, int lines, int width) {
+	// minified json, every line is one very long record
+	for (int l = 0; l < lines; l++) {
+		int len = fprintf(fp, "{\"records\":[");
+		for (int i = 0; len < width; i++) {
+			if (i) len += fprintf(fp, ",");
+			len += fprintf(fp, "{\"id\":%d,\"name\":\"item %d\",\"price\":%d.%02d,\"tags\":[\"a\",\"b\"]}",
+										 i, i, i % 1000, i % 100);
+		}
+		fputs("]}\n", fp);
+	}
+}
+
+static void genTSV(FILE *fp, int lines, int fields) {
+	for (int l = 0; l < lines; l++) {
+		for (int f = 0; f < fields; f++) {
+			if (f) fputc('\t', fp);
+			if (f % 3 == 0) fprintf(fp, "%d", l * fields + f);
+			else if (f % 3 == 1) fprintf(fp, "name_%d", l % 977);
+			else fprintf(fp, "%d.%d", l % 100, f);
+		}
+		fputc('\n', fp);
+	}
+}
+
+/*** traces ***/
+
+#define KEY_UP "\x1b[A"
+#define KEY_DOWN "\x1b[B"
+#define KEY_RIGHT "\x1b[C"
+#define KEY_LEFT "\x1b[D"
+#define KEY_HOME "\x1b[H"
+#define KEY_END "\x1b[F"
+#define KEY_PGUP "\x1b[5~"
+#define KEY_PGDN "\x1b[6~"
+#define KEY_BS "\x7f"
+
+struct benchOp {
+	const char *keys; // handled as one frame, a search prompt is a single op
+	int times;
+};
+
+// the same trace runs on every file
+static const struct benchOp trace[] = {
+	{KEY_PGDN, 300},
+	{KEY_DOWN, 300},
+	{KEY_RIGHT, 200},
+	{"x", 200},
+	{" = 1;\r", 20},
+	{KEY_END, 50},
+	{KEY_HOME, 50},
+	{KEY_BS, 150},
+	{"\x1a", 100}, // undo
+	{"\x19", 100}, // redo
+	{"\x06" "count\r", 5}, // find
+	{KEY_UP, 300},
+	{KEY_PGUP, 300},
+	{KEY_LEFT, 200},
+};
+
+#define TRACE_OPS (sizeof(trace) / sizeof(trace[0]))
+
+/*** running ***/
+
+static long long benchNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static int cmpll(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static void benchFeed(const char *keys) {
+	// what the terminal would have sent, handled the way the main loop does
+	int len = strlen(keys);
+	memcpy(IN.buf, keys, len);
+	IN.pos = 0;
+	IN.len = len;
+	while (IN.pos < IN.len) editorProcessKeypress();
+}
+
+static double ms(long long ns) {
+	return ns / 1e6;
+}
+
+static void benchFile(const char *name, const char *path, const char *query) {
+	struct abuf sink = ABUF_INIT;
+	S.sink = &sink;
+	E.screenrows = 48;
+	E.screencols = 160;
+	E.follow.fd = E.follow.ifd = -1;
+
+	long long t = benchNow();
+	editorOpen((char *)path);
+	long long open = benchNow() - t;
+
+	t = benchNow();
+	while (editorSyntaxPending()) editorSyntaxIdle(1000);
+	long long highlight = benchNow() - t;
+
+	// count every match on the worker threads
+	t = benchNow();
+	searchReset();
+	editorFindCallback((char *)query, query[0]);
+	while (editorSearchPending()) {
+		struct timespec ts = {0, 50000};
+		nanosleep(&ts, NULL);
+		editorSearchPoll();
+	}
+	long long search = benchNow() - t;
+	int matches = SC.total;
+	editorFindCallback((char *)query, '\x1b');
+	while (editorSearchBusy()) ;
+
+	int nframes = 0;
+	for (unsigned int i = 0; i < TRACE_OPS; i++) nframes += trace[i].times;
+	long long *frames = malloc(sizeof(long long) * nframes);
+	int f = 0;
+	editorRefreshScreen();
+	long long start = benchNow();
+	for (unsigned int i = 0; i < TRACE_OPS; i++) {
+		for (int r = 0; r < trace[i].times; r++) {
+			t = benchNow();
+			benchFeed(trace[i].keys);
+			editorRefreshScreen();
+			frames[f++] = benchNow() - t;
+		}
+	}
+	long long total = benchNow() - start;
+	size_t out = sink.len;
+	qsort(frames, nframes, sizeof(long long), cmpll);
+
+	char *saved = malloc(strlen(path) + 5);
+	sprintf(saved, "%s.out", path);
+	free(E.filename);
+	E.filename = saved;
+	t = benchNow();
+	editorSave();
+	long long save = benchNow() - t;
+	unlink(saved);
+
+	printf("%-10s %8d rows  open %7.1fms  highlight %7.1fms  search %7.1fms (%d)  save %7.1fms\n",
+				 name, E.numrows, ms(open), ms(highlight), ms(search), matches, ms(save));
+	printf("%-10s %8d keys  %9.0f ops/s  frame p50 %6.1fus  p99 %7.1fus  max %7.1fus  %6.1fMB drawn\n",
+				 "", nframes, nframes / (total / 1e9), frames[nframes / 2] / 1e3,
+				 frames[(long long)nframes * 99 / 100] / 1e3, frames[nframes - 1] / 1e3,
+				 out / 1048576.0);
+	free(frames);
+}
+
+int main(int argc, char *argv[]) {
+	const char *dir = argc > 1 ? argv[1] : "/tmp";
+	struct {
+		const char *name, *file, *query;
+		int kind;
+	} inputs[] = {
+		{"c-1M", "kilo-bench.c", "count", 0},
+		{"json-long", "kilo-bench.json", "price", 1},
+		{"tsv-tabs", "kilo-bench.tsv", "name_9", 2},
+	};
+
+	for (unsigned int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", dir, inputs[i].file);
+		FILE *fp = fopen(path, "w");
+		if (fp == NULL) {
+			perror(path);
+			return 1;
+		}
+		if (inputs[i].kind == 0) genC(fp, 1000000);
+		else if (inputs[i].kind == 1) genJSON(fp, 8, 4 << 20);
+		else genTSV(fp, 300000, 16);
+		fclose(fp);
+
+		// each file gets a fresh editor, a child process is the easy way to
+		// have one
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) {
+			benchFile(inputs[i].name, path, inputs[i].query);
+			exit(0);
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		unlink(path);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s failed\n", inputs[i].name);
+			return 1;
+		}
+	}
+	return 0;
+}
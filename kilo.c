@@ -9,22 +9,56 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 
 /*** defines ***/
 
 #define KILO_VERSION "1.0.0"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_SAVE_IOVECS 512 // rows go to writev this many buffers at a time
+#define KILO_HL_SLICE_MS 5 // background highlighting runs this long between polls
+#define KILO_SEARCH_POLL_MS 10 // how often to check on a search running in the background
+#define KILO_INPUT_BUF 4096 // bytes taken from stdin in one read
+#define KILO_INPUT_WAIT_MS 100 // how long the rest of an escape sequence gets to arrive
+#define KILO_MESSAGE_SECS 5 // status messages go away after this long
+#define KILO_FOLLOW_POLL_MS 250 // follow mode checks this often without inotify
+#define KILO_FOLLOW_READ (1 << 20) // most bytes follow mode appends between polls
+#define KILO_JOURNAL_DELAY_MS 1000 // edits go to the autosave journal this long after them
+#define KILO_JOURNAL_POLL_MS 50 // how often to check on a journal write
+#define KILO_JOURNAL_COMPACT (4 << 20) // journals past this are rewritten if the text is smaller
+#define KILO_JOURNAL_RETRY_MS 1000 // first wait after a failed journal write, it doubles each time
+#define KILO_JOURNAL_RETRY_MAX_MS (60 * 1000) // and stops doubling here
+#define KILO_JOURNAL_GIVE_UP 5 // failures in a row with the same error before autosave is turned off
+#define KILO_BUFFER_CAP (512 << 20) // bytes of text kept loaded across buffers, the rest get evicted
+#define KILO_COLD_ROWS (1 << 16) // rows this far from the screen get packed away
+#define KILO_COLD_CHUNK_MAX (4 << 20) // chunks with more text than this are left alone
 
 // 0x1f is a hexadecimal that we're using as a bitmask
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -40,7 +74,9 @@ enum editorKey {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_START, // bracketed paste, ESC[200~ and ESC[201~
+	PASTE_END
 };
 
 enum editorHighlight {
@@ -57,8 +93,219 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define ROW_MAPPED (1<<0) // chars points into E.map and isn't nul terminated
+#define ROW_UNRENDERED (1<<1) // render and hl haven't been built yet
+#define ROW_OPEN_COMMENT (1<<2) // the row ends inside a multiline comment
+#define ROW_HL_VALID (1<<3) // hl, or just the comment state while unrendered, is up to date
+#define ROW_HL_IN (1<<4) // and was worked out starting inside a multiline comment
+#define ROW_JOINED (1<<5) // the line goes on in the next row, no newline after this one
+
+// a line longer than this is cut into several rows, so everything about a
+// row fits an int, its render with every tab expanded included
+#define KILO_ROW_MAX (1 << 27)
+
+#ifndef KILO_UNDO_LIMIT
+#define KILO_UNDO_LIMIT (16 << 20) // bytes of undo history kept, oldest goes first
+#endif
+#define KILO_UNDO_COALESCE 256 // longest run of typing merged into one record
+
+enum undoOp {
+	UNDO_INSERT = 1, // text went into a row
+	UNDO_DELETE, // text came out of a row
+	UNDO_ROW_INSERT, // a whole row went in
+	UNDO_ROW_DELETE, // a whole row came out
+	UNDO_ROW_JOINED // a row's ROW_JOINED flipped, its own inverse
+};
+
+enum undoKind { // what a key did, runs of the same kind undo together
+	UNDO_KIND_OTHER,
+	UNDO_KIND_TYPE,
+	UNDO_KIND_BACKSPACE,
+	UNDO_KIND_DELETE
+};
+
+// the undo history is a log of the primitive edits, each record holding
+// just the text it put in or took out. records sit back to back in one
+// buffer, with their size at both ends so the log can be walked either
+// way. records sharing a group are undone as a unit
+struct undoLog {
+	char *buf;
+	size_t len; // bytes of records
+	size_t cur; // records before cur are done, the ones after were undone
+	size_t cap;
+	unsigned int group;
+	int kind; // undoKind of the last key
+	int last; // last character typed
+	int cx, cy; // cursor when the current key started
+	int replaying; // undoing or redoing, don't log the edits it makes
+};
+
+// follow mode, what gets written to the end of the file is appended to
+// the buffer as it comes in, like tail -f
+struct followState {
+	int on;
+	int fd; // the file, -1 after it was moved away until it turns up again
+	int ifd, wd; // inotify watch on it, ifd is -1 when polling instead
+	off_t pos; // bytes of the file that are in the buffer
+	int partial; // the last row had no newline yet, more of it may follow
+	int backlog; // there was more to read than one go takes
+};
+
+// autosave, every edit goes into a journal next to the file so a crash
+// loses at most the last second or so. records are the same as the undo
+// log's and get merged the same way, they're written out on a worker
+// thread and replayed by editorOpen if it finds a journal for the file as
+// it is on disk. once the journal is bigger than the text would be it gets
+// rewritten as a copy of the text instead
+struct journalJob;
+
+struct journalState {
+	char *path; // NULL without a file name
+	char *buf; // records not handed to a writer yet
+	size_t len, cap;
+	size_t last; // offset of the last record in buf
+	long long due; // CLOCK_MONOTONIC ms buf has to go out by
+	size_t written; // bytes in the journal file
+	int created; // the file is there with a header for this version
+	int broken; // a write failed, the file can't be appended to any more
+	int failures; // writes failed in a row with the same error
+	int error; // errno of the last of them
+	int backoff; // ms waited after the last failure before trying again
+	int replaying; // recovering, don't log the edits that makes
+	unsigned int gen; // bumped when the journal starts over, older jobs don't count
+	off_t base_size; // the file the journal goes on top of
+	struct timespec base_mtime;
+	struct journalJob *job; // write in flight
+};
+
+// soft wrap, long rows are folded onto as many screen lines as they need.
+// every row keeps how many visual lines it takes and the row tree sums
+// them per subtree, so going between file rows and screen lines is a walk
+// down or up the tree. a resize only bumps the epoch, chunks with an older
+// one get their counts redone when they are scrolled to or by a
+// background pass
+struct wrapState {
+	int on;
+	int top; // visual line of the row at rowoff that is shown first
+	int cols; // width the counts are worked out for
+	int epoch; // chunks last counted in an older one are out of date
+	int next; // where the background pass carries on from
+};
+
+// rows far from the screen let go of their render and hl, editorRowRender
+// builds them again. a chunk of them whose text is all its own (none of it
+// in the map, that's the page cache's to drop) gets its chars packed into
+// one compressed block, it's unpacked the moment a row in it is looked at.
+// a background pass goes over the buffer whenever the screen has moved far
+// enough or enough chunks were unpacked, so only what's around the screen
+// and what was touched lately is kept as it is
+struct coldState {
+	int next; // where the background pass carries on from
+	int anchor; // rowoff when the pass started
+	int thawed; // chunks unpacked since then
+};
+
+// snapshots hand worker threads a version of the text that doesn't change
+// under them while the UI thread goes on editing. a snapshot is a list of
+// frozen per chunk tables of row text, a chunk keeps its table until one of
+// its rows changes so the next snapshot only copies the chunks edited since.
+// row buffers a snapshot may be reading are copied before they are edited
+// and the old ones retired, they're freed once every snapshot that could
+// still see them has been let go of. workers only ever drop a reference,
+// the UI thread does all the freeing, so neither side waits on the other
+struct snapRetired {
+	void *p;
+	size_t len; // of a mapping, cap is -1 for those
+	int cap;
+	unsigned int epoch; // newest snapshot when it was retired
+};
+
+struct snapRow {
+	const char *chars;
+	int size;
+	int joined; // no newline after it
+};
+
+struct snapChunk {
+	int refs; // snapshots holding it, plus one while it's its chunk's current table
+	int count;
+	const char *cold; // the chunk's packed text when it was cold, chars are NULL then
+	int coldlen;
+	struct snapRow rows[]; // count of them
+};
+
+struct snapState {
+	unsigned int epoch; // of the newest snapshot, they're numbered from 1
+	struct textSnapshot *live; // snapshots not freed yet, newest first
+	struct snapRetired *retired;
+	int nretired, retiredcap;
+};
+
 /*** data ***/
 
+// keywords hashed by the whole word, with the length and which kind they
+// are worked out once instead of on every lookup
+struct keywordTable {
+	unsigned int mask; // slots - 1, there's always a free one
+	int maxlen; // longest keyword, anything longer can't be one
+	struct keywordSlot {
+		const char *word; // NULL for an empty slot
+		int len;
+		int hl; // HL_KEYWORD1 or HL_KEYWORD2
+	} slots[];
+};
+
+#define LEX_MAX_QUOTES 4
+
+enum lexState {
+	LX_SEP, // plain text, the last byte was a separator
+	LX_WORD, // plain text, in the middle of a word
+	LX_NUMBER, // just after a digit of a number
+	LX_COMMENT, // in a multiline comment
+	LX_STRING, // in a string, then the byte after a backslash in it,
+	           // a pair of states for each kind of quote
+	LX_MAX = LX_STRING + 2 * LEX_MAX_QUOTES
+};
+
+enum lexClass {
+	LC_SEP,
+	LC_WORD,
+	LC_DIGIT,
+	LC_DOT,
+	LC_BACKSLASH,
+	LC_MARK, // could start a comment marker, base[] says what it is otherwise
+	LC_QUOTE, // one class for each kind of quote
+	LC_MAX = LC_QUOTE + LEX_MAX_QUOTES
+};
+
+enum lexAction {
+	LA_NONE,
+	LA_MARK, // check for a comment marker, go by base[] if there isn't one
+	LA_WORD // check for a keyword
+};
+
+// a syntax compiled down to tables, see lexCompile
+struct lexTable {
+	unsigned char cls[256];
+	unsigned char base[256];
+	unsigned char sep[256]; // where words end
+	struct lexMove {
+		unsigned char next;
+		unsigned char hl;
+		unsigned char action;
+	} moves[LX_MAX][LC_MAX];
+	struct lexDelim {
+		const char *s;
+		int len;
+		int hl;
+		int next;
+		int rest; // runs to the end of the line
+	} delims[LX_MAX][2];
+	int ndelims[LX_MAX];
+	int nquotes;
+	struct keywordTable *keywords;
+};
+
 struct editorSyntax {
 	char *filetype;
 	char **filematch;
@@ -67,41 +314,154 @@ struct editorSyntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+	struct lexTable *lexer; // compiled from the rest the first time it's needed
 };
 
+typedef struct tabstop {
+	int cx; // index of a tab in chars
+	int rx; // render column right after it
+} tabstop;
+
+// a row is split in two. erow has what passes over the whole buffer look
+// at (search, save, the comment state, wrap counts), erender what only
+// drawing and the cursor need. a chunk keeps them in two parallel arrays,
+// so scanning the rows of a chunk walks 40 byte erows without dragging the
+// rest along, and the render array is only there while a row in the chunk
+// is rendered
 typedef struct erow { // editor row
-	int idx;
-	int size;
-	int rsize;
+	struct rowchunk *chunk; // chunk holding this row, line numbers come from the tree
 	char *chars;
+	int size;
+	int flags; // ROW_* bits
+	int charscap; // bytes allocated for chars, 0 while it points into the map
+	unsigned int born; // snapshot epoch chars was allocated in, see snapState
+	int wraps; // visual lines the row takes up in soft wrap mode
+} erow;
+
+typedef struct erender {
 	char *render;
 	unsigned char *hl;
-	int hl_open_comment;
-} erow;
+	tabstop *tabs; // every tab in the row, in order
+	int rsize;
+	int ntabs;
+	// bytes allocated for each buffer, they come from the arena and grow a
+	// size class at a time
+	int rendercap, hlcap, tabscap;
+} erender;
+
+// row buffers are carved out of big slabs, a free list per power of two
+// size class. a row that grows moves up a class, a row that goes away puts
+// its blocks back on the lists, and the whole lot is dropped by releasing
+// the slabs. buffers too big for any class are malloced on their own but
+// still kept on a list so a release gets them too. slabs are aligned to
+// their size and count the blocks out of them, so once enough of them have
+// nothing in use they can be handed back one by one
+#define KILO_ARENA_MIN 16 // smallest block, also the alignment of every block
+#define KILO_ARENA_CLASSES 9 // 16 bytes up to 4k
+#define KILO_ARENA_SLAB (64 * 1024)
+#define KILO_ARENA_TRIM 64 // slabs gone empty before it's worth looking for them
+
+typedef struct arenaSlab { // at the start of every slab
+	int live; // blocks handed out of it and not back yet
+} arenaSlab;
+
+typedef struct arenaBig {
+	struct arenaBig *prev, *next;
+} arenaBig;
+
+struct rowArena {
+	char **slabs;
+	int nslabs, slabscap;
+	char *bump; // rest of the newest slab
+	size_t left;
+	void *free[KILO_ARENA_CLASSES]; // blocks handed back, linked through themselves
+	arenaBig *big;
+	int emptied; // times a slab's live count went to 0 since the last trim
+};
+
+// rows live in fixed size chunks, and the chunks are the nodes of a treap
+// ordered by position in the file. each node knows how many rows are in its
+// subtree, so looking up, inserting or deleting a line only walks one path
+// down (or up) the tree instead of shifting every row behind it
+#define KILO_CHUNK_ROWS 256
+
+typedef struct rowchunk {
+	struct rowchunk *left, *right, *parent;
+	unsigned int prio; // random heap priority, keeps the tree balanced
+	int count; // rows stored in this chunk
+	int nrows; // rows stored in this chunk and both subtrees
+	size_t cbytes; // what the rows in this chunk take in the file, newlines included
+	size_t bytes; // the same for this chunk and both subtrees
+	int cjoined; // rows in this chunk with no newline after them, see ROW_JOINED
+	int joined; // the same for this chunk and both subtrees
+	int cwraps; // visual lines of the rows in this chunk, see wrapState
+	int wraps; // the same for this chunk and both subtrees
+	int wrap_epoch; // wrap epoch the rows in this chunk were counted in
+	struct snapChunk *snap; // frozen copy of the text of the rows, if one is current
+	char *cold; // text of every row back to back and packed, see coldState
+	int coldlen, coldcap;
+	erow rows[KILO_CHUNK_ROWS];
+	erender *render; // render[i] goes with rows[i], NULL while no row is rendered
+} rowchunk;
 
 // global editor state
 struct editorConfig {
 	int cx, cy; // cursor location
 	int rx; // index into the render field
+	int sy, sx; // where the cursor goes on screen, worked out by editorScroll
 	int rowoff; // row offset, keeps track of what row of a file the user currently is scrolled to
 	int coloff; // same as rowoff, but for columns
 	int screenrows; // max number of rows that can be displayed
 	int screencols; // max cols displayed
+	int linenumbers; // show line numbers in front of the rows
+	int gutter; // columns they take up, 0 without them. worked out by editorScroll
 	int numrows; // number of rows
-	erow *row; // an array of pointers to each row
-	// row represents an array of pointers to rows, whenever we want to
-	// add a new row, we realloc the ptr to E.row and give it a new size
+	rowchunk *rowtree; // root of the row tree, use editorRowAt() to get a row
+	struct undoLog undo;
+	struct followState follow;
+	struct wrapState wrap;
+	struct coldState cold;
+	struct snapState snap;
+	struct journalState journal;
 	int dirty; // flag that tells us if a file has been edited after loading it in
 	char *filename;
+	char *map; // read only mapping of the opened file, rows point into it
+	size_t maplen;
 	char statusmsg[80];
 	time_t statusmsg_time;
 	struct editorSyntax *syntax;
+	int hl_frontier; // rows above this one have an up to date comment state
+	int hl_resume; // rows between the frontier and this were lexed from the
+	               // state of the row above them, just maybe an outdated one
 	struct termios orig_termios;
 };
 
 // declare new editorConfig struct with variable name E
 struct editorConfig E;
 
+struct rowArena A; // where row buffers come from, shared by every buffer
+
+// every open file is a whole editorConfig. the one being edited is E and
+// the rest are parked here, a switch copies the struct in and out so a
+// buffer comes back with its rows, highlighting, undo log and scroll
+// position just as they were. buffers not looked at for a while let go of
+// their rows once the loaded ones pass KILO_BUFFER_CAP, only clean ones,
+// and are read in again when they're switched back to
+struct editorBuffer {
+	struct editorConfig e; // stale for the current buffer, that one is E
+	unsigned long used; // when it was last switched away from
+	int evicted; // only the file name and the cursor are left
+};
+
+struct bufferList {
+	struct editorBuffer *bufs;
+	int len, cap; // len is 0 until a second file is opened
+	int cur; // slot E belongs in
+	unsigned long tick;
+};
+
+struct bufferList B;
+
 /*** filetypes ***/
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
 
@@ -119,7 +479,8 @@ struct editorSyntax HLDB[] = {
 		C_HL_extensions,
 		C_HL_keywords,
 		"//", "/*", "*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		NULL
 	},
 };
 
@@ -127,12 +488,183 @@ struct editorSyntax HLDB[] = {
 
 /*** prototypes ***/
 
-void editorSetStatusMessage(const char *fmt, ...) {}
+void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen(void);
+void editorScreenInvalidate(void);
+void editorRowRender(erow *row);
+void editorChunkThaw(rowchunk *c);
+int editorSyntaxPending(void);
+int editorSyntaxIdle(int budget_ms);
+int editorWrapPending(void);
+void editorWrapIdle(int budget_ms);
+int editorColdPending(void);
+void editorColdIdle(int budget_ms);
+int editorSearchPending(void);
+int editorSearchPoll(void);
+int editorSearchBusy(void);
+void editorSnapCollect(void);
+void editorJournalLog(int op, int row, int pos, const char *s, int len);
+int editorJournalTimeout(void);
+void editorJournalPoll(void);
+void editorJournalOpen(void);
+void editorJournalReset(void);
+void editorJournalDiscard(void);
+int editorBufferTimeout(void);
+void editorBufferPoll(void);
+void editorFollowRewatch(void);
+int editorFollowFd(void);
+int editorFollowTimeout(void);
+int editorFollowPoll(int ready);
+void editorUndoLog(int op, int row, int pos, const char *s, int len);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
 struct termios orig_termios; // store original terminal attributes
 
+/*** profiling ***/
+
+// build with -DKILO_PROFILE (make profile) to time the phases of the main
+// loop. without it the PROF_ macros are empty and none of this exists
+#ifdef KILO_PROFILE
+
+enum profMetric {
+	PROF_WAIT, // waiting for a key in editorReadKey
+	PROF_KEY, // handling it in editorProcessKeypress
+	PROF_SYNTAX, // editorUpdateSyntax
+	PROF_DRAW, // editorDrawRows
+	PROF_WRITE, // the write at the end of editorRefreshScreen
+	PROF_ALLOCS, // row and append buffer allocations per frame
+	PROF_BYTES, // bytes written to the terminal per frame
+	PROF_METRICS
+};
+
+#define PROF_BUCKETS 256 // four to each power of two
+
+struct profHist {
+	unsigned long long count, sum, max;
+	unsigned long long bucket[PROF_BUCKETS];
+};
+
+struct profState {
+	struct profHist hist[PROF_METRICS];
+	unsigned long long allocs; // in the frame so far
+	int show; // stats go in the status bar, Ctrl-P
+};
+
+struct profState P;
+
+static const char *prof_names[PROF_METRICS] = {
+	"wait", "key", "syntax", "draw", "write", "allocs", "bytes"
+};
+
+static unsigned long long profNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int profBucket(unsigned long long v) {
+	// log-linear buckets, the numbers below 4 get one each
+	if (v < 4) return v;
+	int msb = 63 - __builtin_clzll(v);
+	return msb * 4 + ((v >> (msb - 2)) & 3) - 4;
+}
+
+static unsigned long long profBucketLow(int b) {
+	if (b < 4) return b;
+	return (unsigned long long)(4 + (b + 4) % 4) << ((b + 4) / 4 - 2);
+}
+
+void profRecord(int metric, unsigned long long v) {
+	struct profHist *h = &P.hist[metric];
+	h->count++;
+	h->sum += v;
+	if (v > h->max) h->max = v;
+	h->bucket[profBucket(v)]++;
+}
+
+void profFrame(size_t bytes) {
+	profRecord(PROF_ALLOCS, P.allocs);
+	profRecord(PROF_BYTES, bytes);
+	P.allocs = 0;
+}
+
+static unsigned long long profPercentile(struct profHist *h, int pct) {
+	// the bottom of the bucket the pct-th percentile falls in
+	if (h->count == 0) return 0;
+	unsigned long long want = (h->count * pct + 99) / 100, seen = 0;
+	for (int b = 0; b < PROF_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= want) return profBucketLow(b);
+	}
+	return h->max;
+}
+
+static int profFormat(char *buf, size_t size, int metric, unsigned long long v) {
+	if (metric == PROF_ALLOCS) return snprintf(buf, size, "%llu", v);
+	if (metric == PROF_BYTES) {
+		if (v < 1024) return snprintf(buf, size, "%lluB", v);
+		return snprintf(buf, size, "%.1fk", v / 1024.0);
+	}
+	if (v < 1000) return snprintf(buf, size, "%lluns", v);
+	if (v < 1000000) return snprintf(buf, size, "%lluus", v / 1000);
+	if (v < 1000000000) return snprintf(buf, size, "%.1fms", v / 1e6);
+	return snprintf(buf, size, "%.1fs", v / 1e9);
+}
+
+int profStatus(char *buf, int size) {
+	// p50/p99 of the phases that make up a keystroke, for the status bar
+	static const int shown[] = {PROF_KEY, PROF_SYNTAX, PROF_DRAW, PROF_WRITE, PROF_BYTES};
+	static const char *labels[] = {"key", "syn", "draw", "wr", "out"};
+	int len = 0;
+	for (unsigned int i = 0; i < sizeof(shown) / sizeof(shown[0]) && len < size; i++) {
+		struct profHist *h = &P.hist[shown[i]];
+		char p50[16], p99[16];
+		profFormat(p50, sizeof(p50), shown[i], profPercentile(h, 50));
+		profFormat(p99, sizeof(p99), shown[i], profPercentile(h, 99));
+		len += snprintf(buf + len, size - len, "%s%s %s/%s", i ? " " : "", labels[i], p50, p99);
+	}
+	return len < size ? len : size - 1;
+}
+
+void profDump(void) {
+	// on exit, write every histogram to $KILO_PROFILE_FILE if it's set
+	char *path = getenv("KILO_PROFILE_FILE");
+	if (path == NULL) return;
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) return;
+	for (int m = 0; m < PROF_METRICS; m++) {
+		struct profHist *h = &P.hist[m];
+		char mean[16], p50[16], p90[16], p99[16], max[16];
+		profFormat(mean, sizeof(mean), m, h->count ? h->sum / h->count : 0);
+		profFormat(p50, sizeof(p50), m, profPercentile(h, 50));
+		profFormat(p90, sizeof(p90), m, profPercentile(h, 90));
+		profFormat(p99, sizeof(p99), m, profPercentile(h, 99));
+		profFormat(max, sizeof(max), m, h->max);
+		fprintf(fp, "%s: n=%llu mean=%s p50=%s p90=%s p99=%s max=%s\n",
+						prof_names[m], h->count, mean, p50, p90, p99, max);
+		// bucket bottoms, in ns for the timings
+		for (int b = 0; b < PROF_BUCKETS; b++) {
+			if (h->bucket[b] == 0) continue;
+			fprintf(fp, "  %14llu %llu\n", profBucketLow(b), h->bucket[b]);
+		}
+	}
+	fclose(fp);
+}
+
+#define PROF_START(t) unsigned long long t = profNow()
+#define PROF_END(metric, t) profRecord(metric, profNow() - (t))
+#define PROF_ALLOC() (P.allocs++)
+#define PROF_FRAME(bytes) profFrame(bytes)
+
+#else
+
+#define PROF_START(t)
+#define PROF_END(metric, t)
+#define PROF_ALLOC()
+#define PROF_FRAME(bytes)
+
+#endif
+
 /*** terminal ***/
 
 void die(const char *s) {
@@ -148,6 +680,7 @@ void die(const char *s) {
 }
 
 void disableRawMode(void) {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
 		die("tcsetattr");
 }
@@ -170,63 +703,19 @@ void enableRawMode(void) {
 	// ICANON is a local bitflag, when enabled it tells the terminal to wait for
 	// <return> before writing input to STDIO
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;
+	// read never blocks, all the waiting is done in poll so the editor
+	// sleeps for real when there's nothing to do
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 	// send raw to stdin
 	// TCSAFLUSH says when to apply the changes, first drain output, then flush input
 	// this means wait for all pending output to be written to terminal,
 	// then discards any input that hasn't been read
-}
-
-int editorReadKey(void) {
-	// read keys sent to stdin
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) die("read"); // if fail on read
-	}
-
-	if (c == '\x1b') { // if theres an escape sequence...
-		char seq[3]; // capture the next 3 characters in the sequence
-
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b'; // if fail on read
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b'; // if fail on read
 
-		if (seq[0] == '[') { // validate the sequence
-			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-				if (seq[2] == '~') {
-					switch (seq[1]) {
-					case '1': return HOME_KEY;
-					case '3': return DEL_KEY;
-					case '4': return END_KEY;
-					case '5': return PAGE_UP;
-					case '6': return PAGE_DOWN;
-					case '7': return HOME_KEY;
-					case '8': return END_KEY;
-					}
-				}
-			} else {
-				switch (seq[1]) {
-				case 'A': return ARROW_UP;
-				case 'B': return ARROW_DOWN;
-				case 'C': return ARROW_RIGHT;
-				case 'D': return ARROW_LEFT;
-				case 'H': return HOME_KEY;
-				case 'F': return END_KEY;
-				}
-			}
-		} else if (seq[0] == 'O') {
-			switch (seq[1]) {
-			case 'H': return HOME_KEY;
-			case 'F': return END_KEY;
-			}
-		}
-		return '\x1b';
-	} else { // if not an escape seq, return the character
-		return c;
-	}
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
+	// bracketed paste, the terminal wraps pasted text in ESC[200~ ... ESC[201~
+	// so it can go in as one block instead of being typed key by key
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -234,6 +723,8 @@ int getCursorPosition(int *rows, int *cols) {
   unsigned int i = 0;
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
   while (i < sizeof(buf) - 1) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, KILO_INPUT_WAIT_MS) <= 0) break; // reads don't wait in raw mode
     if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
     if (buf[i] == 'R') break;
     i++;
@@ -262,474 +753,4665 @@ int getWindowSize(int *rows, int *cols) {
 	}
 }
 
-/*** syntax highlighting ***/
-
-int is_separator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+void editorUpdateWindowSize(void) {
+	if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+	E.screenrows -= 2; // room for the status and message bars
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-  if (E.syntax == NULL) return;
+struct inputBuffer {
+	// bytes read from stdin that haven't been turned into keys yet. one read
+	// takes everything the terminal has sent, so a paste doesn't cost a
+	// syscall per byte
+	char buf[KILO_INPUT_BUF];
+	int pos, len;
+};
 
-	char **keywords = E.syntax->keywords;
+struct inputBuffer IN;
+
+static int inputFill(int wait) {
+	// wait up to wait ms for input, then take whatever is there in one read.
+	// returns how many bytes came in
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	if (poll(&pfd, 1, wait) <= 0) return 0;
+	if (IN.pos == IN.len) {
+		IN.pos = IN.len = 0;
+	} else if (IN.len == KILO_INPUT_BUF) {
+		memmove(IN.buf, IN.buf + IN.pos, IN.len - IN.pos);
+		IN.len -= IN.pos;
+		IN.pos = 0;
+	}
+	int nread = read(STDIN_FILENO, IN.buf + IN.len, KILO_INPUT_BUF - IN.len);
+	if (nread == -1 && errno != EAGAIN) die("read");
+	if (nread <= 0) return 0;
+	IN.len += nread;
+	return nread;
+}
 
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;
+static int inputByte(char *c) {
+	// next byte, if it turns up soon enough
+	if (IN.pos == IN.len && inputFill(KILO_INPUT_WAIT_MS) == 0) return 0;
+	*c = IN.buf[IN.pos++];
+	return 1;
+}
 
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
+int editorInputPending(void) {
+	// are there more keys that can be handled before the next redraw
+	if (IN.pos < IN.len) return 1;
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	return poll(&pfd, 1, 0) > 0;
+}
 
-  int prev_sep = 1;
-	int in_string = 0;
-	int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+int winch_pipe[2] = {-1, -1};
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+static void sigwinchHandler(int sig) {
+	(void)sig;
+	int saved = errno;
+	write(winch_pipe[1], "", 1);
+	errno = saved;
+}
 
-		if (scs_len && !in_string && !in_string && !in_comment) {
-			if (!strncmp(&row->render[i], scs, scs_len)) {
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
-		}
+void editorWatchResize(void) {
+	// the resize signal just pokes a pipe, the event loop polls the other end
+	// and deals with it outside the handler
+	if (pipe(winch_pipe) == -1) die("pipe");
+	for (int i = 0; i < 2; i++) {
+		fcntl(winch_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(winch_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigwinchHandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
 
-		if (mcs_len && mce_len && !in_string) {
-			if (in_comment) {
-				row->hl[i] = HL_MLCOMMENT;
-				if (!strncmp(&row->render[i], mce, mce_len)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					prev_sep = 1;
-					continue;
-				} else {
-					i++;
-					continue;
-				}
-			} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
-			}
-		}
+static int editorMessageTimeout(void) {
+	// ms until the status message has to be taken down, -1 if it doesn't
+	if (E.statusmsg[0] == '\0') return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long ms = (E.statusmsg_time + KILO_MESSAGE_SECS - now.tv_sec) * 1000 -
+		now.tv_nsec / 1000000;
+	return ms > 0 ? (int)ms : -1;
+}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				row->hl[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->rsize) {
-					row->hl[i + 1] = HL_STRING;
-					i+=2;
-					continue;
-				}
-				if (c == in_string) in_string = 0;
-				i++;
-				prev_sep = 1;
-				continue;
-			} else {
-				if (c == '"' || c == '\'') {
-					in_string = c;
-					row->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
-			}
+static void editorWaitInput(void) {
+	// the event loop, sleeps in poll until there are keys to read. in the
+	// meantime it handles resizes, takes down an old status message, keeps
+	// background highlighting, wrapping and cooling going and checks on a
+	// running search. with none of that going on it blocks without a timeout
+	while (IN.pos == IN.len) {
+		editorSnapCollect();
+		int timeout = editorMessageTimeout();
+		int expiring = timeout >= 0;
+		if (editorSearchPending() && (timeout < 0 || timeout > KILO_SEARCH_POLL_MS))
+			timeout = KILO_SEARCH_POLL_MS;
+		int follow = editorFollowTimeout();
+		if (follow >= 0 && (timeout < 0 || timeout > follow)) timeout = follow;
+		int journal = editorJournalTimeout();
+		if (journal >= 0 && (timeout < 0 || timeout > journal)) timeout = journal;
+		int buffers = editorBufferTimeout();
+		if (buffers >= 0 && (timeout < 0 || timeout > buffers)) timeout = buffers;
+		if (editorSyntaxPending() || editorWrapPending() || editorColdPending()) timeout = 0;
+
+		struct pollfd fds[3] = {
+			{STDIN_FILENO, POLLIN, 0},
+			{winch_pipe[0], POLLIN, 0},
+			{editorFollowFd(), POLLIN, 0} // poll skips it when it's -1
+		};
+		int n = poll(fds, 3, timeout);
+		if (n == -1 && errno != EINTR) die("poll");
+
+		int redraw = 0;
+		if (n > 0 && fds[1].revents) {
+			char buf[64];
+			while (read(winch_pipe[0], buf, sizeof(buf)) > 0) ;
+			editorUpdateWindowSize();
+			redraw = 1;
 		}
+		if (n > 0 && fds[0].revents) {
+			if (inputFill(0) > 0) break;
+			if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) exit(1); // the terminal went away
+		}
+		if (editorSearchPoll()) redraw = 1;
+		if (editorFollowPoll(n > 0 && fds[2].revents)) redraw = 1;
+		editorJournalPoll();
+		editorBufferPoll();
+		if (editorSyntaxPending() && editorSyntaxIdle(KILO_HL_SLICE_MS)) redraw = 1;
+		editorWrapIdle(KILO_HL_SLICE_MS);
+		editorColdIdle(KILO_HL_SLICE_MS);
+		if (expiring && editorMessageTimeout() < 0) redraw = 1;
+		if (redraw) editorRefreshScreen();
+	}
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
-        continue;
-      }
-    }
+int editorReadKey(void) {
+	// read keys sent to stdin
+	char c;
+	PROF_START(wait);
+	do editorWaitInput(); while (!inputByte(&c));
+	PROF_END(PROF_WAIT, wait);
 
+	if (c == '\x1b') { // if theres an escape sequence...
+		char seq[3]; // capture the next characters in the sequence
 
-		if (prev_sep) {
-			int j;
-			for (j = 0; keywords[j]; j++) {
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen - 1] == '|';
-				if (kw2) klen--;
+		if (!inputByte(&seq[0])) return '\x1b'; // if fail on read
+		if (!inputByte(&seq[1])) return '\x1b'; // if fail on read
 
-				if (!strncmp(&row->render[i], keywords[j], klen) &&
-						is_separator(row->render[i + klen])) {
-					memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
-					break;
+		if (seq[0] == '[') { // validate the sequence
+			if (seq[1] >= '0' && seq[1] <= '9') {
+				// a number and then ~, the paste markers have three digits
+				int num = seq[1] - '0';
+				while (1) {
+					if (!inputByte(&seq[2])) return '\x1b';
+					if (seq[2] < '0' || seq[2] > '9') break;
+					if (num < 1000) num = num * 10 + seq[2] - '0';
+				}
+				if (seq[2] == '~') {
+					switch (num) {
+					case 1: return HOME_KEY;
+					case 3: return DEL_KEY;
+					case 4: return END_KEY;
+					case 5: return PAGE_UP;
+					case 6: return PAGE_DOWN;
+					case 7: return HOME_KEY;
+					case 8: return END_KEY;
+					case 200: return PASTE_START;
+					case 201: return PASTE_END;
+					}
+				}
+			} else {
+				switch (seq[1]) {
+				case 'A': return ARROW_UP;
+				case 'B': return ARROW_DOWN;
+				case 'C': return ARROW_RIGHT;
+				case 'D': return ARROW_LEFT;
+				case 'H': return HOME_KEY;
+				case 'F': return END_KEY;
 				}
 			}
-			if (keywords[j] != NULL) {
-				prev_sep = 0;
-				continue;
+		} else if (seq[0] == 'O') {
+			switch (seq[1]) {
+			case 'H': return HOME_KEY;
+			case 'F': return END_KEY;
 			}
 		}
-
-		
-    prev_sep = is_separator(c);
-    i++;
-  }
-
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < E.numrows) {
-		editorUpdateSyntax(&E.row[row->idx + 1]);
-	}
-}
-
-int editorSyntaxToColor(int hl) {
-	switch (hl) {
-	case HL_COMMENT:
-	case HL_MLCOMMENT: return 36;
-	case HL_KEYWORD1: return 33;
-	case HL_KEYWORD2: return 32;
-	case HL_STRING: return 35;
-	case HL_NUMBER: return 31;
-	case HL_MATCH: return 34;
-	default: return 37;
+		return '\x1b';
+	} else { // if not an escape seq, return the character
+		return c;
 	}
 }
 
-void editorSelectSyntaxHighlight() {
-  E.syntax = NULL;
-  if (E.filename == NULL) return;
-  char *ext = strrchr(E.filename, '.');
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
+/*** row memory ***/
 
-				int filerow;
-				for (filerow = 0; filerow < E.numrows; filerow++) {
-					editorUpdateSyntax(&E.row[filerow]);
-				}
+static int arenaClass(size_t size) {
+	if (size <= KILO_ARENA_MIN) return 0;
+	return 32 - __builtin_clz((unsigned int)(size - 1)) - 4;
+}
 
-        return;
-      }
-      i++;
-    }
-  }
+static arenaSlab *arenaSlabOf(void *p) {
+	return (arenaSlab *)((uintptr_t)p & ~(uintptr_t)(KILO_ARENA_SLAB - 1));
 }
 
-/*** row operations ***/
+static void arenaPush(struct rowArena *a, char *p, int class) {
+	*(void **)p = a->free[class];
+	a->free[class] = p;
+}
 
-int editorRowCxToRx(erow *row, int cx) {
-	// compute render position?
-	int rx = 0;
-	int j;
-	for (j = 0; j < cx; j++) {
-		if (row->chars[j] == '\t')
-			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-		rx++;
+static void arenaRefill(struct rowArena *a) {
+	// the end of the old slab is too small for the block that's wanted, but
+	// it's still good for smaller ones
+	while (a->left >= KILO_ARENA_MIN) {
+		int class = arenaClass(a->left + 1) - 1;
+		size_t size = (size_t)KILO_ARENA_MIN << class;
+		arenaPush(a, a->bump, class);
+		a->bump += size;
+		a->left -= size;
+	}
+	if (a->nslabs == a->slabscap) {
+		a->slabscap = a->slabscap ? a->slabscap * 2 : 16;
+		a->slabs = realloc(a->slabs, sizeof(char *) * a->slabscap);
 	}
-	return rx;
+	void *slab;
+	if (posix_memalign(&slab, KILO_ARENA_SLAB, KILO_ARENA_SLAB)) die("posix_memalign");
+	((arenaSlab *)slab)->live = 0;
+	a->slabs[a->nslabs++] = slab;
+	a->bump = (char *)slab + KILO_ARENA_MIN;
+	a->left = KILO_ARENA_SLAB - KILO_ARENA_MIN;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t')
-			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-		cur_rx++;
-
-		if (cur_rx > rx) return cx;
+void *rowAlloc(size_t size, int *cap) {
+	// a block of at least size bytes, its real size goes in cap
+	struct rowArena *a = &A;
+	PROF_ALLOC();
+	if (size > INT_MAX) die("rowAlloc"); // rows are kept under KILO_ROW_MAX
+	int class = arenaClass(size);
+	if (class >= KILO_ARENA_CLASSES) {
+		arenaBig *big = malloc(sizeof(arenaBig) + size);
+		if (big == NULL) die("malloc");
+		big->prev = NULL;
+		big->next = a->big;
+		if (a->big) a->big->prev = big;
+		a->big = big;
+		*cap = size;
+		return big + 1;
+	}
+	size_t blocksize = (size_t)KILO_ARENA_MIN << class;
+	*cap = blocksize;
+	char *p = a->free[class];
+	if (p) {
+		a->free[class] = *(void **)p;
+	} else {
+		if (a->left < blocksize) arenaRefill(a);
+		p = a->bump;
+		a->bump += blocksize;
+		a->left -= blocksize;
 	}
-	return cx;
+	arenaSlabOf(p)->live++;
+	return p;
 }
 
-void editorUpdateRow(erow *row) {
-	// figures out how to render the row
-	// primarily used to render tabs
-	int tabs = 0;
-	int j;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') tabs++;
+void rowFree(void *p, int cap) {
+	if (p == NULL || cap == 0) return;
+	struct rowArena *a = &A;
+	int class = arenaClass(cap);
+	if (class >= KILO_ARENA_CLASSES) {
+		arenaBig *big = (arenaBig *)p - 1;
+		if (big->prev) big->prev->next = big->next;
+		else a->big = big->next;
+		if (big->next) big->next->prev = big->prev;
+		free(big);
+		return;
 	}
-	
-	free(row->render);
-	row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+	if (--arenaSlabOf(p)->live == 0) a->emptied++;
+	arenaPush(a, p, class);
+}
 
-	
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row -> chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-		} else {
-			row->render[idx++] = row->chars[j];
+void *rowGrow(void *p, int *cap, size_t size, size_t keep) {
+	// make sure a block holds size bytes, keeping its first keep. growing
+	// at least doubles, so a row typed a character at a time only moves now
+	// and then
+	if (p && (size_t)*cap >= size) return p;
+	if (size < (size_t)*cap * 2 && (size_t)*cap * 2 <= INT_MAX) size = (size_t)*cap * 2;
+	int newcap;
+	void *n = rowAlloc(size, &newcap);
+	if (keep) memcpy(n, p, keep);
+	rowFree(p, *cap);
+	*cap = newcap;
+	return n;
+}
+
+void rowArenaTrim(void) {
+	// give back the slabs nothing is using. their blocks are spread over the
+	// free lists, so the lists get walked to take them out, which is only
+	// done once a fair share of the slabs could be empty
+	struct rowArena *a = &A;
+	if (a->emptied < KILO_ARENA_TRIM || a->emptied < a->nslabs / 8) return;
+	a->emptied = 0;
+	char *cur = a->slabs[a->nslabs - 1]; // the one being carved up
+	for (int class = 0; class < KILO_ARENA_CLASSES; class++) {
+		void **pp = &a->free[class];
+		while (*pp) {
+			arenaSlab *s = arenaSlabOf(*pp);
+			if (s->live == 0 && (char *)s != cur) *pp = **(void ***)pp;
+			else pp = *pp;
 		}
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
+	int kept = 0;
+	for (int i = 0; i < a->nslabs; i++) {
+		if (a->slabs[i] != cur && ((arenaSlab *)a->slabs[i])->live == 0) free(a->slabs[i]);
+		else a->slabs[kept++] = a->slabs[i];
+	}
+	a->nslabs = kept;
+}
 
-	editorUpdateSyntax(row);
+void rowArenaRelease(void) {
+	// let go of every row buffer at once, for when every buffer's rows go away
+	struct rowArena *a = &A;
+	int i;
+	for (i = 0; i < a->nslabs; i++) free(a->slabs[i]);
+	free(a->slabs);
+	while (a->big) {
+		arenaBig *next = a->big->next;
+		free(a->big);
+		a->big = next;
+	}
+	memset(a, 0, sizeof(*a));
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-	// create and insert a new row
+/*** row tree ***/
 
-	if (at < 0 || at > E.numrows) return;
+static unsigned int chunkRandom(void) {
+	// xorshift, only used to pick treap priorities
+	static unsigned int state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
 
-	// allocate space for new row
-	E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+static int chunkRows(rowchunk *c) {
+	return c ? c->nrows : 0;
+}
 
-	// move everything from [at] to [numrows], over 1
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-	// E.row represents an array of pointers to rows, whenever we want to
-	// we realloc space for it, and move things over to insert it
+static size_t chunkBytes(rowchunk *c) {
+	return c ? c->bytes : 0;
+}
 
-	// memmove will allocate and handle the move of everything from &E.row[at] to
-	// sizeof(erow) * (E.numrows - at)
-	// so it can fit the new row in
+static size_t rowBytes(erow *row) {
+	// what a row takes in the file, its newline included if it has one
+	return (size_t)row->size + !(row->flags & ROW_JOINED);
+}
 
-	for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+static int chunkWraps(rowchunk *c) {
+	return c ? c->wraps : 0;
+}
 
-	E.row[at].idx = at;
+static int chunkJoined(rowchunk *c) {
+	return c ? c->joined : 0;
+}
 
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+static void chunkDropSnap(rowchunk *c) {
+	// the chunk's rows changed, its frozen table is only good for snapshots
+	// that already have it
+	struct snapChunk *t = c->snap;
+	if (t == NULL) return;
+	c->snap = NULL;
+	if (--t->refs == 0) free(t);
+}
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hl_open_comment = 0;
-	editorUpdateRow(&E.row[at]);
+static void chunkPull(rowchunk *c) {
+	c->nrows = chunkRows(c->left) + c->count + chunkRows(c->right);
+	c->bytes = chunkBytes(c->left) + c->cbytes + chunkBytes(c->right);
+	c->joined = chunkJoined(c->left) + c->cjoined + chunkJoined(c->right);
+	c->wraps = chunkWraps(c->left) + c->cwraps + chunkWraps(c->right);
+}
 
-	E.numrows++;
-	E.dirty++;
+static void chunkFixup(rowchunk *c) {
+	// a chunk changed its row count, update every subtree total above it
+	for (; c; c = c->parent) chunkPull(c);
 }
 
-void editorFreeRow(erow *row) {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+static void chunkReplaceChild(rowchunk *parent, rowchunk *old, rowchunk *new) {
+	if (parent == NULL) E.rowtree = new;
+	else if (parent->left == old) parent->left = new;
+	else parent->right = new;
+	if (new) new->parent = parent;
 }
 
-void editorDelRow(int at) {
-	if (at < 0 || at >= E.numrows) return;
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at+1], sizeof(erow) * (E.numrows - at - 1));
-	for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
+static void chunkRotateUp(rowchunk *c) {
+	// rotate c above its parent, in-order position of every chunk is kept
+	rowchunk *p = c->parent;
+	chunkReplaceChild(p->parent, p, c);
+	if (p->left == c) {
+		p->left = c->right;
+		if (p->left) p->left->parent = p;
+		c->right = p;
+	} else {
+		p->right = c->left;
+		if (p->right) p->right->parent = p;
+		c->left = p;
+	}
+	p->parent = c;
+	chunkPull(p);
+	chunkPull(c);
+}
+
+static rowchunk *chunkNew(void) {
+	rowchunk *c = malloc(sizeof(rowchunk));
+	if (c == NULL) die("malloc");
+	c->left = c->right = c->parent = NULL;
+	c->prio = chunkRandom();
+	c->count = 0;
+	c->nrows = 0;
+	c->cbytes = c->bytes = 0;
+	c->cjoined = c->joined = 0;
+	c->cwraps = c->wraps = 0;
+	c->wrap_epoch = 0; // rows that go in are counted by the background pass
+	E.wrap.next = 0;
+	c->snap = NULL;
+	c->cold = NULL;
+	c->render = NULL;
+	return c;
+}
+
+static void chunkInsertAfter(rowchunk *prev, rowchunk *c) {
+	// link c into the tree right after prev (or as the first chunk when prev
+	// is NULL), then rotate it up until the heap order holds again
+	if (E.rowtree == NULL) {
+		E.rowtree = c;
+		c->parent = NULL;
+		chunkPull(c);
+		return;
+	}
+	rowchunk *at;
+	if (prev == NULL) {
+		for (at = E.rowtree; at->left; at = at->left);
+		at->left = c;
+	} else if (prev->right == NULL) {
+		at = prev;
+		at->right = c;
+	} else {
+		for (at = prev->right; at->left; at = at->left);
+		at->left = c;
+	}
+	c->parent = at;
+	chunkFixup(c);
+	while (c->parent && c->parent->prio < c->prio) chunkRotateUp(c);
+}
+
+static void chunkRemove(rowchunk *c) {
+	// rotate c down until it is a leaf, then unlink and free it
+	while (c->left || c->right) {
+		rowchunk *child;
+		if (c->left == NULL) child = c->right;
+		else if (c->right == NULL) child = c->left;
+		else child = (c->left->prio > c->right->prio) ? c->left : c->right;
+		chunkRotateUp(child);
+	}
+	rowchunk *p = c->parent;
+	chunkReplaceChild(p, c, NULL);
+	chunkFixup(p);
+	chunkDropSnap(c);
+	free(c->render);
+	free(c);
+}
+
+static rowchunk *chunkFirst(rowchunk *c) {
+	if (c) while (c->left) c = c->left;
+	return c;
+}
+
+static rowchunk *chunkNext(rowchunk *c) {
+	if (c->right) return chunkFirst(c->right);
+	while (c->parent && c->parent->right == c) c = c->parent;
+	return c->parent;
+}
+
+static rowchunk *chunkPrev(rowchunk *c) {
+	if (c->left) {
+		for (c = c->left; c->right; c = c->right);
+		return c;
+	}
+	while (c->parent && c->parent->left == c) c = c->parent;
+	return c->parent;
+}
+
+static rowchunk *chunkFind(int *at) {
+	// find the chunk holding row *at and turn *at into an index inside it.
+	// *at == E.numrows resolves to one past the last row of the last chunk
+	rowchunk *c = E.rowtree;
+	while (c) {
+		int l = chunkRows(c->left);
+		if (*at < l) {
+			c = c->left;
+		} else if (*at - l < c->count || (*at - l == c->count && !c->right)) {
+			*at -= l;
+			return c;
+		} else {
+			*at -= l + c->count;
+			c = c->right;
+		}
+	}
+	return NULL;
+}
+
+erow *editorRowAt(int at) {
+	if (at < 0 || at >= E.numrows) return NULL;
+	rowchunk *c = chunkFind(&at);
+	if (c->cold) editorChunkThaw(c);
+	return &c->rows[at];
+}
+
+int editorRowIndex(erow *row) {
+	// the line number isn't stored anywhere, count the rows in front of this
+	// one by walking from its chunk up to the root
+	rowchunk *c = row->chunk;
+	int idx = (row - c->rows) + chunkRows(c->left);
+	for (; c->parent; c = c->parent) {
+		if (c->parent->right == c)
+			idx += chunkRows(c->parent->left) + c->parent->count;
+	}
+	return idx;
+}
+
+erow *editorRowNext(erow *row) {
+	rowchunk *c = row->chunk;
+	if (row + 1 < &c->rows[c->count]) return row + 1;
+	c = chunkNext(c);
+	if (c && c->cold) editorChunkThaw(c);
+	return c ? &c->rows[0] : NULL;
+}
+
+erow *editorRowPrev(erow *row) {
+	rowchunk *c = row->chunk;
+	if (row > c->rows) return row - 1;
+	c = chunkPrev(c);
+	if (c && c->cold) editorChunkThaw(c);
+	return c ? &c->rows[c->count - 1] : NULL;
+}
+
+static void chunkRenderNew(rowchunk *c) {
+	// rows that aren't rendered have an all zero render half
+	c->render = calloc(KILO_CHUNK_ROWS, sizeof(erender));
+	if (c->render == NULL) die("calloc");
+}
+
+erender *editorRowDisplay(erow *row) {
+	// the render half of a row, it sits at the same index in the chunk
+	rowchunk *c = row->chunk;
+	if (c->render == NULL) chunkRenderNew(c);
+	return &c->render[row - c->rows];
+}
+
+size_t editorRowOffset(erow *row) {
+	// where the row starts in the file, from the byte totals of the chunks
+	// in front of it and the rows in front of it in its own chunk
+	rowchunk *c = row->chunk;
+	size_t off = chunkBytes(c->left);
+	erow *r;
+	for (r = c->rows; r < row; r++) off += rowBytes(r);
+	for (; c->parent; c = c->parent) {
+		if (c->parent->right == c)
+			off += chunkBytes(c->parent->left) + c->parent->cbytes;
+	}
+	return off;
+}
+
+size_t editorBufferBytes(void) {
+	return chunkBytes(E.rowtree);
+}
+
+int editorLineCount(void) {
+	// lines in the file, the rows a long line was cut into count once
+	return E.numrows - chunkJoined(E.rowtree);
+}
+
+int editorRowLine(erow *row) {
+	// the file line a row is part of, counted like editorRowIndex counts
+	// rows. every row in front of it with a newline after it ends a line
+	rowchunk *c = row->chunk;
+	int line = chunkRows(c->left) - chunkJoined(c->left);
+	for (erow *r = c->rows; r < row; r++) line += !(r->flags & ROW_JOINED);
+	for (; c->parent; c = c->parent) {
+		rowchunk *p = c->parent;
+		if (p->right == c)
+			line += chunkRows(p->left) - chunkJoined(p->left) + p->count - p->cjoined;
+	}
+	return line;
+}
+
+int editorLineRow(int line) {
+	// the first row of a file line, E.numrows past the last one. that's the
+	// row after the line'th one with a newline, found going down the tree
+	if (line <= 0) return 0;
+	if (line >= editorLineCount()) return E.numrows;
+	rowchunk *c = E.rowtree;
+	int at = 0;
+	while (c) {
+		int l = chunkRows(c->left) - chunkJoined(c->left);
+		if (line <= l) {
+			c = c->left;
+			continue;
+		}
+		line -= l;
+		at += chunkRows(c->left);
+		if (line <= c->count - c->cjoined) {
+			for (int j = 0; j < c->count; j++)
+				if (!(c->rows[j].flags & ROW_JOINED) && --line == 0) return at + j + 1;
+		}
+		line -= c->count - c->cjoined;
+		at += c->count;
+		c = c->right;
+	}
+	return E.numrows;
+}
+
+int editorOffsetRow(size_t off, int *col) {
+	// the row byte off of the file is in and its index in chars there, a
+	// newline goes with the row in front of it. past the end of the file is
+	// the end of the last row
+	rowchunk *c = E.rowtree;
+	*col = 0;
+	if (c == NULL) return 0;
+	if (off >= chunkBytes(c)) {
+		*col = editorRowAt(E.numrows - 1)->size;
+		return E.numrows - 1;
+	}
+	int at = 0;
+	while (c) {
+		size_t l = chunkBytes(c->left);
+		if (off < l) {
+			c = c->left;
+			continue;
+		}
+		off -= l;
+		at += chunkRows(c->left);
+		if (off < c->cbytes) {
+			for (int j = 0; j < c->count; j++) {
+				erow *row = &c->rows[j];
+				if (off < rowBytes(row)) {
+					*col = off < (size_t)row->size ? (int)off : row->size;
+					return at + j;
+				}
+				off -= rowBytes(row);
+			}
+		}
+		off -= c->cbytes;
+		at += c->count;
+		c = c->right;
+	}
+	return E.numrows - 1;
+}
+
+void editorRowSetSize(erow *row, int size) {
+	// every size change goes through here to keep the byte totals right
+	size_t delta = (size_t)size - (size_t)row->size; // wraps when shrinking
+	chunkDropSnap(row->chunk);
+	row->size = size;
+	row->chunk->cbytes += delta;
+	rowchunk *c;
+	for (c = row->chunk; c; c = c->parent) c->bytes += delta;
+}
+
+void editorRowSetJoined(erow *row, int joined) {
+	// the newline after a row comes or goes, without going through undo
+	if (!(row->flags & ROW_JOINED) == !joined) return;
+	size_t delta = joined ? (size_t)-1 : 1;
+	int count = joined ? 1 : -1;
+	chunkDropSnap(row->chunk);
+	row->flags ^= ROW_JOINED;
+	row->chunk->cbytes += delta;
+	row->chunk->cjoined += count;
+	for (rowchunk *c = row->chunk; c; c = c->parent) {
+		c->bytes += delta;
+		c->joined += count;
+	}
+}
+
+static void chunkSetOwner(rowchunk *c, int from) {
+	for (int j = from; j < c->count; j++) c->rows[j].chunk = c;
+}
+
+static void chunkMove(rowchunk *dst, int to, rowchunk *src, int from, int n) {
+	// move n rows, both halves of them, and their bytes along with them
+	if (dst->cold) editorChunkThaw(dst);
+	if (src->cold) editorChunkThaw(src);
+	chunkDropSnap(dst);
+	chunkDropSnap(src);
+	memmove(&dst->rows[to], &src->rows[from], sizeof(erow) * n);
+	if (src->render) {
+		if (dst->render == NULL) chunkRenderNew(dst);
+		memmove(&dst->render[to], &src->render[from], sizeof(erender) * n);
+	} else if (dst->render) {
+		memset(&dst->render[to], 0, sizeof(erender) * n);
+	}
+	if (dst == src) return;
+	size_t bytes = 0;
+	int wraps = 0, joined = 0;
+	int j;
+	for (j = to; j < to + n; j++) {
+		bytes += rowBytes(&dst->rows[j]);
+		wraps += dst->rows[j].wraps;
+		joined += (dst->rows[j].flags & ROW_JOINED) != 0;
+	}
+	dst->cbytes += bytes;
+	src->cbytes -= bytes;
+	dst->cjoined += joined;
+	src->cjoined -= joined;
+	dst->cwraps += wraps;
+	src->cwraps -= wraps;
+	if (dst->wrap_epoch != src->wrap_epoch) {
+		dst->wrap_epoch = 0;
+		E.wrap.next = 0;
+	}
+}
+
+erow *editorRowTreeInsert(int at, int size) {
+	// make room for a new row of size bytes at position at and return it,
+	// zeroed. the caller fills in the contents
+	rowchunk *c = chunkFind(&at);
+	if (c == NULL) {
+		c = chunkNew();
+		chunkInsertAfter(NULL, c);
+		at = 0;
+	}
+	if (at == KILO_CHUNK_ROWS) {
+		// appending to a full chunk (like when loading a file), start a fresh
+		// one instead of splitting so chunks stay packed
+		rowchunk *n = chunkNew();
+		chunkInsertAfter(c, n);
+		c = n;
+		at = 0;
+	} else if (c->count == KILO_CHUNK_ROWS) {
+		// chunk is full, move its upper half into a new chunk right after it
+		int half = KILO_CHUNK_ROWS / 2;
+		rowchunk *n = chunkNew();
+		n->wrap_epoch = c->wrap_epoch;
+		n->count = c->count - half;
+		chunkMove(n, 0, c, half, n->count);
+		chunkSetOwner(n, 0);
+		c->count = half;
+		chunkFixup(c);
+		chunkInsertAfter(c, n);
+		if (at > half) {
+			at -= half;
+			c = n;
+		}
+	}
+	chunkMove(c, at + 1, c, at, c->count - at);
+	c->count++;
+	chunkSetOwner(c, at + 1);
+	memset(&c->rows[at], 0, sizeof(erow));
+	if (c->render) memset(&c->render[at], 0, sizeof(erender));
+	c->rows[at].chunk = c;
+	c->rows[at].size = size;
+	c->cbytes += (size_t)size + 1;
+	c->rows[at].wraps = 1; // until it's counted
+	c->cwraps++;
+	chunkFixup(c);
+	return &c->rows[at];
+}
+
+void editorRowTreeDelete(int at) {
+	// drop row at from its chunk, the caller already freed its contents
+	rowchunk *c = chunkFind(&at);
+	c->cbytes -= rowBytes(&c->rows[at]);
+	c->cjoined -= (c->rows[at].flags & ROW_JOINED) != 0;
+	c->cwraps -= c->rows[at].wraps;
+	chunkMove(c, at, c, at + 1, c->count - at - 1);
+	c->count--;
+	chunkSetOwner(c, at);
+	if (c->count == 0) {
+		chunkRemove(c);
+		return;
+	}
+	chunkFixup(c);
+	// fold a mostly empty chunk into its neighbour so lots of deletes don't
+	// leave a tree full of tiny chunks behind
+	rowchunk *n = chunkNext(c);
+	if (n && c->count < KILO_CHUNK_ROWS / 4 && c->count + n->count <= KILO_CHUNK_ROWS) {
+		chunkMove(c, c->count, n, 0, n->count);
+		int from = c->count;
+		c->count += n->count;
+		chunkSetOwner(c, from);
+		chunkFixup(c);
+		n->count = 0;
+		chunkFixup(n);
+		chunkRemove(n);
+	}
+}
+
+/*** packing ***/
+
+// a small LZ77 coder for the text of cold rows, laid out like an LZ4
+// block. each sequence is a token (literal count in the high nibble, match
+// length past the minimum in the low one, 15 meaning more length bytes
+// follow), the literals, then a two byte offset back into what's been
+// unpacked so far and the rest of the match length. the last sequence is
+// only literals
+#define PACK_HASH_BITS 12
+#define PACK_MIN_MATCH 4
+
+static size_t packBound(size_t n) {
+	// most n bytes can pack to, when nothing in them matches
+	return n + n / 255 + 16;
+}
+
+static unsigned int packHash(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - PACK_HASH_BITS);
+}
+
+static unsigned char *packLength(unsigned char *out, size_t len) {
+	// the part of a length that didn't fit its nibble, 255 at a time
+	for (; len >= 255; len -= 255) *out++ = 255;
+	*out++ = len;
+	return out;
+}
+
+static unsigned char *packSequence(unsigned char *out, const unsigned char *lit,
+																	 size_t litlen, size_t off, size_t matchlen) {
+	size_t ml = matchlen ? matchlen - PACK_MIN_MATCH : 0;
+	*out++ = (litlen < 15 ? litlen : 15) << 4 | (ml < 15 ? ml : 15);
+	if (litlen >= 15) out = packLength(out, litlen - 15);
+	memcpy(out, lit, litlen);
+	out += litlen;
+	if (matchlen) {
+		*out++ = off & 0xff;
+		*out++ = off >> 8;
+		if (ml >= 15) out = packLength(out, ml - 15);
+	}
+	return out;
+}
+
+size_t packText(const char *src, size_t n, char *dst) {
+	// pack n bytes into dst, which has room for packBound(n) of them, and
+	// return how many it took. n has to be under 4GB
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	uint32_t table[1 << PACK_HASH_BITS]; // where each hash was last seen, plus one
+	memset(table, 0, sizeof(table));
+	size_t anchor = 0, i = 0;
+	// the last few bytes always go out as literals, so nothing has to check
+	// for the end while a match is being looked for
+	while (i + 12 <= n) {
+		unsigned int h = packHash(in + i);
+		size_t cand = table[h];
+		table[h] = i + 1;
+		if (cand == 0 || i - (cand - 1) > 65535 || memcmp(in + cand - 1, in + i, PACK_MIN_MATCH)) {
+			// step further the longer nothing has matched, text that doesn't
+			// pack isn't worth looking at a byte at a time
+			i += 1 + ((i - anchor) >> 6);
+			continue;
+		}
+		cand--;
+		size_t len = PACK_MIN_MATCH;
+		while (i + len < n - 5 && in[cand + len] == in[i + len]) len++;
+		out = packSequence(out, in + anchor, i - anchor, i - cand, len);
+		i += len;
+		anchor = i;
+	}
+	out = packSequence(out, in + anchor, n - anchor, 0, 0);
+	return out - (unsigned char *)dst;
+}
+
+int unpackText(const char *src, size_t len, char *dst, size_t n) {
+	// undo packText, n is the size it was packed from. returns -1 if src
+	// doesn't unpack to exactly n bytes
+	const unsigned char *in = (const unsigned char *)src, *end = in + len;
+	unsigned char *out = (unsigned char *)dst, *oend = out + n;
+	while (in < end) {
+		unsigned int token = *in++;
+		size_t litlen = token >> 4;
+		if (litlen == 15) {
+			unsigned char b;
+			do {
+				if (in == end) return -1;
+				b = *in++;
+				litlen += b;
+			} while (b == 255);
+		}
+		if (litlen > (size_t)(end - in) || litlen > (size_t)(oend - out)) return -1;
+		memcpy(out, in, litlen);
+		in += litlen;
+		out += litlen;
+		if (in == end) break; // the last one has no match
+		if (end - in < 2) return -1;
+		size_t off = in[0] | in[1] << 8;
+		in += 2;
+		size_t ml = token & 15;
+		if (ml == 15) {
+			unsigned char b;
+			do {
+				if (in == end) return -1;
+				b = *in++;
+				ml += b;
+			} while (b == 255);
+		}
+		ml += PACK_MIN_MATCH;
+		if (off == 0 || off > (size_t)(out - (unsigned char *)dst) || ml > (size_t)(oend - out))
+			return -1;
+		const unsigned char *from = out - off;
+		if (off >= ml) {
+			memcpy(out, from, ml);
+		} else {
+			for (size_t j = 0; j < ml; j++) out[j] = from[j]; // the match overlaps itself
+		}
+		out += ml;
+	}
+	return out == oend ? 0 : -1;
+}
+
+/*** snapshots ***/
+
+struct textSnapshot {
+	struct textSnapshot *next;
+	unsigned int epoch;
+	int refs; // dropped by any thread, the UI thread frees it once it's 0
+	int numrows;
+	int nchunks;
+	struct snapChunk **chunks;
+	int *first; // row each chunk starts at
+};
+
+// where a worker unpacks the cold chunks of a snapshot it reads, one at a
+// time. zeroed to start with, editorSnapReaderFree when done
+struct snapReader {
+	const struct snapChunk *t; // the one that's unpacked
+	char *text;
+	size_t cap;
+	struct snapRow rows[KILO_CHUNK_ROWS];
+};
+
+static int snapLive(struct textSnapshot *s) {
+	// a snapshot nobody holds can't be picked up again, it only waits to be freed
+	return __atomic_load_n(&s->refs, __ATOMIC_ACQUIRE) > 0;
+}
+
+static unsigned int snapOldest(void) {
+	// epoch of the oldest snapshot still being read
+	unsigned int oldest = UINT_MAX;
+	for (struct textSnapshot *s = E.snap.live; s; s = s->next)
+		if (snapLive(s) && s->epoch < oldest) oldest = s->epoch;
+	return oldest;
+}
+
+int editorSnapShared(erow *row) {
+	// could a snapshot be reading the row's chars. snapshots see the
+	// buffers that were there when they were taken, so only the ones
+	// taken since chars was allocated can
+	for (struct textSnapshot *s = E.snap.live; s; s = s->next)
+		if (s->epoch > row->born && snapLive(s)) return 1;
+	return 0;
+}
+
+static void snapRetire(void *p, size_t len, int cap) {
+	// free p, or unmap it with cap -1, once no snapshot can see it
+	if (E.snap.live == NULL) {
+		if (cap == -1) munmap(p, len);
+		else rowFree(p, cap);
+		return;
+	}
+	if (E.snap.nretired == E.snap.retiredcap) {
+		E.snap.retiredcap = E.snap.retiredcap ? E.snap.retiredcap * 2 : 64;
+		E.snap.retired = realloc(E.snap.retired, sizeof(struct snapRetired) * E.snap.retiredcap);
+	}
+	struct snapRetired *r = &E.snap.retired[E.snap.nretired++];
+	r->p = p;
+	r->len = len;
+	r->cap = cap;
+	r->epoch = E.snap.epoch;
+}
+
+void editorSnapRetireRow(erow *row) {
+	// the row's chars are going away or being replaced
+	if (row->flags & ROW_MAPPED) return;
+	if (editorSnapShared(row)) snapRetire(row->chars, 0, row->charscap);
+	else rowFree(row->chars, row->charscap);
+}
+
+void editorSnapCollect(void) {
+	// free the snapshots every worker is done with, then whatever was
+	// retired while only those could see it
+	struct textSnapshot **sp = &E.snap.live;
+	while (*sp) {
+		struct textSnapshot *s = *sp;
+		if (snapLive(s)) {
+			sp = &s->next;
+			continue;
+		}
+		*sp = s->next;
+		for (int i = 0; i < s->nchunks; i++) {
+			if (--s->chunks[i]->refs == 0) free(s->chunks[i]);
+		}
+		free(s->chunks);
+		free(s->first);
+		free(s);
+	}
+	unsigned int oldest = snapOldest();
+	int kept = 0;
+	for (int i = 0; i < E.snap.nretired; i++) {
+		struct snapRetired *r = &E.snap.retired[i];
+		if (r->epoch >= oldest) {
+			E.snap.retired[kept++] = *r;
+		} else if (r->cap == -1) {
+			munmap(r->p, r->len);
+		} else {
+			rowFree(r->p, r->cap);
+		}
+	}
+	E.snap.nretired = kept;
+}
+
+struct textSnapshot *editorSnapshot(void) {
+	// the text as it is right now, for the caller to read from any thread and
+	// hand back with editorSnapRelease. chunks nothing changed in since the
+	// last snapshot share their table with it
+	editorSnapCollect();
+	struct textSnapshot *s = malloc(sizeof(struct textSnapshot));
+	if (s == NULL) die("malloc");
+	s->epoch = ++E.snap.epoch;
+	s->refs = 1;
+	s->numrows = E.numrows;
+	s->nchunks = 0;
+	int cap = E.numrows / KILO_CHUNK_ROWS + 1;
+	s->chunks = malloc(sizeof(struct snapChunk *) * cap);
+	s->first = malloc(sizeof(int) * cap);
+
+	int at = 0;
+	for (rowchunk *c = chunkFirst(E.rowtree); c; c = chunkNext(c)) {
+		if (c->snap == NULL) {
+			struct snapChunk *t = malloc(sizeof(struct snapChunk) +
+																	 sizeof(struct snapRow) * c->count);
+			if (t == NULL) die("malloc");
+			t->refs = 1;
+			t->count = c->count;
+			t->cold = c->cold; // retired rather than freed while this could see it
+			t->coldlen = c->coldlen;
+			for (int j = 0; j < c->count; j++) {
+				t->rows[j].chars = c->rows[j].chars;
+				t->rows[j].size = c->rows[j].size;
+				t->rows[j].joined = (c->rows[j].flags & ROW_JOINED) != 0;
+			}
+			c->snap = t;
+		}
+		if (s->nchunks == cap) {
+			cap *= 2;
+			s->chunks = realloc(s->chunks, sizeof(struct snapChunk *) * cap);
+			s->first = realloc(s->first, sizeof(int) * cap);
+		}
+		c->snap->refs++;
+		s->chunks[s->nchunks] = c->snap;
+		s->first[s->nchunks] = at;
+		s->nchunks++;
+		at += c->count;
+	}
+	s->next = E.snap.live;
+	E.snap.live = s;
+	return s;
+}
+
+void editorSnapRelease(struct textSnapshot *s) {
+	// safe from any thread, the memory goes at the next editorSnapCollect
+	if (s) __atomic_sub_fetch(&s->refs, 1, __ATOMIC_RELEASE);
+}
+
+const struct snapRow *editorSnapChunkRows(const struct snapChunk *t, struct snapReader *rd) {
+	// the rows of one table, unpacked into rd first if the chunk was cold.
+	// they're good until the next call with the same reader
+	if (t->cold == NULL) return t->rows;
+	if (rd->t == t) return rd->rows;
+	size_t raw = 0;
+	for (int j = 0; j < t->count; j++) raw += t->rows[j].size;
+	if (raw > rd->cap) {
+		rd->text = realloc(rd->text, raw);
+		if (rd->text == NULL) die("realloc");
+		rd->cap = raw;
+	}
+	if (unpackText(t->cold, t->coldlen, rd->text, raw) == -1) die("unpackText");
+	const char *p = rd->text;
+	for (int j = 0; j < t->count; j++) {
+		rd->rows[j] = t->rows[j];
+		rd->rows[j].chars = p;
+		p += t->rows[j].size;
+	}
+	rd->t = t;
+	return rd->rows;
+}
+
+void editorSnapReaderFree(struct snapReader *rd) {
+	free(rd->text);
+}
+
+const struct snapRow *editorSnapRows(struct textSnapshot *s, int at, int *n, struct snapReader *rd) {
+	// row at of the snapshot, and in *n how many rows follow it (itself
+	// included) before the next call is needed
+	if (at < 0 || at >= s->numrows) return NULL;
+	int lo = 0, hi = s->nchunks - 1;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (s->first[mid] <= at) lo = mid;
+		else hi = mid - 1;
+	}
+	struct snapChunk *t = s->chunks[lo];
+	at -= s->first[lo];
+	*n = t->count - at;
+	return &editorSnapChunkRows(t, rd)[at];
+}
+
+/*** cold rows ***/
+
+struct coldBuf {
+	char *p;
+	size_t cap;
+};
+
+static char *coldScratch(struct coldBuf *b, size_t size) {
+	if (size > b->cap) {
+		b->p = realloc(b->p, size);
+		if (b->p == NULL) die("realloc");
+		b->cap = size;
+	}
+	return b->p;
+}
+
+static size_t chunkTextSize(rowchunk *c) {
+	size_t raw = 0;
+	for (int j = 0; j < c->count; j++) raw += c->rows[j].size;
+	return raw;
+}
+
+static const char *chunkUnpack(rowchunk *c) {
+	// the text of a cold chunk's rows back to back, without thawing it. the
+	// buffer is reused by the next call
+	static struct coldBuf text;
+	size_t raw = chunkTextSize(c);
+	char *p = coldScratch(&text, raw + 1);
+	if (unpackText(c->cold, c->coldlen, p, raw) == -1) die("unpackText");
+	return p;
+}
+
+void editorChunkThaw(rowchunk *c) {
+	// give every row in a cold chunk its chars back, something is about to
+	// look at them
+	if (c->cold == NULL) return;
+	const char *p = chunkUnpack(c);
+	for (int j = 0; j < c->count; j++) {
+		erow *row = &c->rows[j];
+		row->chars = rowAlloc(row->size + 1, &row->charscap);
+		memcpy(row->chars, p, row->size);
+		row->chars[row->size] = '\0';
+		row->born = E.snap.epoch;
+		p += row->size;
+	}
+	snapRetire(c->cold, 0, c->coldcap); // a search may still be unpacking it
+	c->cold = NULL;
+	chunkDropSnap(c);
+	E.cold.thawed++;
+}
+
+static void chunkFreeze(rowchunk *c) {
+	// pack the text of a chunk's rows into one block, if the rows have all
+	// of it to themselves and it comes out a good deal smaller
+	static struct coldBuf text, packed;
+	size_t raw = 0, held = 0;
+	for (int j = 0; j < c->count; j++) {
+		if (c->rows[j].flags & ROW_MAPPED) return;
+		raw += c->rows[j].size;
+		held += c->rows[j].charscap;
+	}
+	if (raw == 0 || raw > KILO_COLD_CHUNK_MAX) return;
+	char *t = coldScratch(&text, raw);
+	char *p = t;
+	for (int j = 0; j < c->count; j++) {
+		memcpy(p, c->rows[j].chars, c->rows[j].size);
+		p += c->rows[j].size;
+	}
+	char *out = coldScratch(&packed, packBound(raw));
+	size_t len = packText(t, raw, out);
+	if (len > held - held / 4) return; // not worth unpacking every time it's looked at
+	c->cold = rowAlloc(len, &c->coldcap);
+	memcpy(c->cold, out, len);
+	c->coldlen = len;
+	for (int j = 0; j < c->count; j++) {
+		editorSnapRetireRow(&c->rows[j]);
+		c->rows[j].chars = NULL;
+		c->rows[j].charscap = 0;
+	}
+	chunkDropSnap(c);
+}
+
+static void chunkCool(rowchunk *c, int first) {
+	// the chunk is far from the screen, first is the index of its first row.
+	// its rows keep their wrap counts and comment states, the rest of the
+	// render half goes
+	if (c->render) {
+		for (int j = 0; j < c->count; j++) {
+			erow *row = &c->rows[j];
+			if (row->flags & ROW_UNRENDERED) continue;
+			erender *r = &c->render[j];
+			rowFree(r->render, r->rendercap);
+			rowFree(r->hl, r->hlcap);
+			rowFree(r->tabs, r->tabscap);
+			row->flags |= ROW_UNRENDERED;
+		}
+		free(c->render);
+		c->render = NULL;
+	}
+	// rows still waiting on their comment state would be unpacked again
+	// straight away by the highlighting pass
+	if (c->cold || (E.syntax && first + c->count > E.hl_frontier)) return;
+	chunkFreeze(c);
+}
+
+static int coldRestart(void) {
+	// the screen moved a long way, or lots of chunks got unpacked since the
+	// pass last started
+	return E.cold.thawed > KILO_COLD_ROWS / KILO_CHUNK_ROWS ||
+		abs(E.rowoff - E.cold.anchor) > KILO_COLD_ROWS / 4;
+}
+
+int editorColdPending(void) {
+	return E.cold.next < E.numrows || coldRestart();
+}
+
+void editorColdIdle(int budget_ms) {
+	// background pass: cool every chunk far enough from the screen
+	if (coldRestart()) {
+		E.cold.next = 0;
+		E.cold.anchor = E.rowoff;
+		E.cold.thawed = 0;
+	}
+	if (E.cold.next >= E.numrows) return;
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int lo = E.rowoff - KILO_COLD_ROWS;
+	int hi = E.rowoff + E.screenrows + KILO_COLD_ROWS;
+	int at = E.cold.next;
+	rowchunk *c = chunkFind(&at);
+	E.cold.next -= at;
+	while (c) {
+		if (E.cold.next + c->count <= lo || E.cold.next >= hi) chunkCool(c, E.cold.next);
+		E.cold.next += c->count;
+		c = chunkNext(c);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long ms = (now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_nsec - start.tv_nsec) / 1000000;
+		if (ms >= budget_ms) break;
+	}
+	if (c == NULL) rowArenaTrim(); // done, the rows packed away left slabs empty
+}
+
+/*** soft wrap ***/
+
+static int wrapTextWidth(const char *chars, int size) {
+	// columns a row's text takes up with its tabs expanded
+	int width = 0;
+	int j = 0;
+	while (j < size) {
+		const char *tab = memchr(&chars[j], '\t', size - j);
+		int run = (tab ? tab - chars : size) - j;
+		width += run;
+		j += run;
+		if (tab) {
+			width += KILO_TAB_STOP - (width % KILO_TAB_STOP);
+			j++;
+		}
+	}
+	return width;
+}
+
+static int wrapRowWidth(erow *row) {
+	// columns the row takes up, worked out from chars when it isn't rendered
+	if (!(row->flags & ROW_UNRENDERED)) return editorRowDisplay(row)->rsize;
+	return wrapTextWidth(row->chars, row->size);
+}
+
+static int wrapRowLines(erow *row) {
+	// a row that exactly fills its last line gets an empty one after it,
+	// that's where the cursor goes at the end of it
+	return wrapRowWidth(row) / E.wrap.cols + 1;
+}
+
+static void wrapSetLines(erow *row, int wraps) {
+	// like editorRowSetSize, keeps the subtree totals right
+	int delta = wraps - row->wraps;
+	if (delta == 0) return;
+	row->wraps = wraps;
+	row->chunk->cwraps += delta;
+	rowchunk *c;
+	for (c = row->chunk; c; c = c->parent) c->wraps += delta;
+}
+
+static void wrapUpdateRow(erow *row) {
+	// a row's text or rendering changed. rows in chunks that are out of date
+	// anyway are left to the pass that counts the whole chunk
+	if (E.wrap.on && row->chunk->wrap_epoch == E.wrap.epoch)
+		wrapSetLines(row, wrapRowLines(row));
+}
+
+static void wrapChunk(rowchunk *c) {
+	// count every row in a chunk that still has counts from before a resize
+	if (c->wrap_epoch == E.wrap.epoch) return;
+	int total = 0;
+	// a cold chunk is counted from its packed text, its rows aren't
+	// rendered and keep no chars
+	const char *text = c->cold ? chunkUnpack(c) : NULL;
+	for (int j = 0; j < c->count; j++) {
+		if (text) {
+			c->rows[j].wraps = wrapTextWidth(text, c->rows[j].size) / E.wrap.cols + 1;
+			text += c->rows[j].size;
+		} else {
+			c->rows[j].wraps = wrapRowLines(&c->rows[j]);
+		}
+		total += c->rows[j].wraps;
+	}
+	c->cwraps = total;
+	c->wrap_epoch = E.wrap.epoch;
+	chunkFixup(c);
+}
+
+static void wrapRows(int from, int to) {
+	// bring the counts of rows from..to up to date, chunk by chunk
+	if (from < 0) from = 0;
+	if (to >= E.numrows) to = E.numrows - 1;
+	if (from > to) return;
+	int at = from;
+	rowchunk *c = chunkFind(&at);
+	for (at = from - at; c && at <= to; c = chunkNext(c)) {
+		wrapChunk(c);
+		at += c->count;
+	}
+}
+
+static int wrapLineAt(int at) {
+	// the first visual line of row at, found the way editorRowIndex counts
+	// rows. row E.numrows is the line after the last one
+	if (at >= E.numrows) return chunkWraps(E.rowtree);
+	erow *row = editorRowAt(at);
+	rowchunk *c = row->chunk;
+	int line = chunkWraps(c->left);
+	for (int j = 0; &c->rows[j] < row; j++) line += c->rows[j].wraps;
+	for (; c->parent; c = c->parent) {
+		if (c->parent->right == c)
+			line += chunkWraps(c->parent->left) + c->parent->cwraps;
+	}
+	return line;
+}
+
+static int wrapRowAt(int line, int *sub) {
+	// the row visual line line is part of, and which of its lines it is.
+	// past the last line that's row E.numrows
+	rowchunk *c = E.rowtree;
+	int at = 0;
+	while (c) {
+		int l = chunkWraps(c->left);
+		if (line < l) {
+			c = c->left;
+		} else if (line - l < c->cwraps) {
+			line -= l;
+			at += chunkRows(c->left);
+			int j = 0;
+			while (line >= c->rows[j].wraps) line -= c->rows[j++].wraps;
+			*sub = line;
+			return at + j;
+		} else {
+			line -= l + c->cwraps;
+			at += chunkRows(c->left) + c->count;
+			c = c->right;
+		}
+	}
+	*sub = 0;
+	return E.numrows;
+}
+
+static void wrapReset(void) {
+	// every count is out of date now, nothing is recounted here though
+	E.wrap.epoch++;
+	E.wrap.cols = E.screencols - E.gutter;
+	E.wrap.next = 0;
+}
+
+int editorWrapPending(void) {
+	return E.wrap.on && E.wrap.next < E.numrows;
+}
+
+void editorWrapIdle(int budget_ms) {
+	// background pass: count the chunks left behind after a resize. the
+	// screen doesn't change, drawing goes by the rows themselves
+	if (!editorWrapPending()) return;
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int at = E.wrap.next;
+	rowchunk *c = chunkFind(&at);
+	E.wrap.next -= at;
+	while (c) {
+		wrapChunk(c);
+		E.wrap.next += c->count;
+		c = chunkNext(c);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long ms = (now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_nsec - start.tv_nsec) / 1000000;
+		if (ms >= budget_ms) break;
+	}
+}
+
+void editorWrapToggle(void) {
+	E.wrap.on = !E.wrap.on;
+	E.wrap.top = 0;
+	E.coloff = 0;
+	if (E.wrap.on) wrapReset();
+	editorScreenInvalidate();
+	editorSetStatusMessage(E.wrap.on ? "Soft wrap on" : "Soft wrap off");
+}
+
+/*** syntax highlighting ***/
+
+int is_separator(int c) {
+	// c is a byte as an unsigned char, isspace can't take a negative one
+	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+static unsigned int keywordHash(const char *s, int len) {
+	unsigned int h = 2166136261u; // fnv-1a
+	for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+static struct keywordTable *keywordTableBuild(char **keywords) {
+	// a keyword ending in | is a type, it gets the second colour
+	int count = 0;
+	while (keywords && keywords[count]) count++;
+	unsigned int size = 16;
+	while (size < (unsigned int)count * 2) size *= 2;
+	struct keywordTable *kt = calloc(1, sizeof(*kt) + size * sizeof(kt->slots[0]));
+	if (kt == NULL) return NULL;
+	kt->mask = size - 1;
+	for (int j = 0; j < count; j++) {
+		int len = strlen(keywords[j]);
+		int kw2 = len > 0 && keywords[j][len - 1] == '|';
+		if (kw2) len--;
+		if (len > kt->maxlen) kt->maxlen = len;
+		unsigned int k = keywordHash(keywords[j], len) & kt->mask;
+		while (kt->slots[k].word) k = (k + 1) & kt->mask;
+		kt->slots[k].word = keywords[j];
+		kt->slots[k].len = len;
+		kt->slots[k].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+	}
+	return kt;
+}
+
+static int keywordLookup(struct keywordTable *kt, const char *s, int len) {
+	// hl type of the word s if it's a keyword, 0 if not
+	unsigned int k = keywordHash(s, len) & kt->mask;
+	for (; kt->slots[k].word; k = (k + 1) & kt->mask) {
+		if (kt->slots[k].len == len && !memcmp(kt->slots[k].word, s, len))
+			return kt->slots[k].hl;
+	}
+	return 0;
+}
+
+static void lexDelimAdd(struct lexTable *lx, int state, const char *s, int hl,
+												int next, int rest) {
+	struct lexDelim *d = &lx->delims[state][lx->ndelims[state]++];
+	d->s = s;
+	d->len = strlen(s);
+	d->hl = hl;
+	d->next = next;
+	d->rest = rest;
+	lx->cls[(unsigned char)s[0]] = LC_MARK;
+}
+
+static void lexMoveSet(struct lexTable *lx, int state, int cls, int next,
+											 int hl, int action) {
+	lx->moves[state][cls].next = next;
+	lx->moves[state][cls].hl = hl;
+	lx->moves[state][cls].action = action;
+}
+
+static struct lexTable *lexCompile(struct editorSyntax *syn) {
+	// turn a syntax's rules into the tables editorHighlightLine runs on.
+	// every byte gets a class, and each state says per class what colour the
+	// byte gets and which state comes next. the only things that need more
+	// than one byte to decide are comment markers, whose first bytes are in
+	// LC_MARK, and keywords, which are looked up at the start of a word.
+	// NULL if there's no memory for it
+	struct lexTable *lx = calloc(1, sizeof(*lx));
+	if (lx == NULL) return NULL;
+	int numbers = syn->flags & HL_HIGHLIGHT_NUMBERS;
+	int strings = syn->flags & HL_HIGHLIGHT_STRINGS;
+	const char *quotes = strings ? "\"'" : "";
+	lx->nquotes = strlen(quotes);
+
+	for (int c = 0; c < 256; c++) {
+		int cls = is_separator(c) ? LC_SEP : LC_WORD;
+		if (numbers && c < 128 && isdigit(c)) cls = LC_DIGIT;
+		if (numbers && c == '.') cls = LC_DOT;
+		if (strings && c == '\\') cls = LC_BACKSLASH;
+		for (int q = 0; q < lx->nquotes; q++)
+			if (c == quotes[q]) cls = LC_QUOTE + q;
+		lx->cls[c] = lx->base[c] = cls;
+		lx->sep[c] = is_separator(c);
+	}
+
+	// plain text, after a separator, inside a word, or right after a number
+	for (int st = LX_SEP; st <= LX_NUMBER; st++) {
+		lexMoveSet(lx, st, LC_SEP, LX_SEP, HL_NORMAL, 0);
+		lexMoveSet(lx, st, LC_WORD, LX_WORD, HL_NORMAL, st == LX_SEP ? LA_WORD : 0);
+		lexMoveSet(lx, st, LC_BACKSLASH, LX_WORD, HL_NORMAL, st == LX_SEP ? LA_WORD : 0);
+		if (st == LX_WORD) lexMoveSet(lx, st, LC_DIGIT, LX_WORD, HL_NORMAL, 0);
+		else lexMoveSet(lx, st, LC_DIGIT, LX_NUMBER, HL_NUMBER, 0);
+		if (st == LX_NUMBER) lexMoveSet(lx, st, LC_DOT, LX_NUMBER, HL_NUMBER, 0);
+		else lexMoveSet(lx, st, LC_DOT, LX_SEP, HL_NORMAL, 0);
+		for (int q = 0; q < lx->nquotes; q++)
+			lexMoveSet(lx, st, LC_QUOTE + q, LX_STRING + 2 * q, HL_STRING, 0);
+		lexMoveSet(lx, st, LC_MARK, st, HL_NORMAL, LA_MARK);
+	}
+	// multiline comment, only its end marker matters
+	for (int cls = 0; cls < LC_MAX; cls++)
+		lexMoveSet(lx, LX_COMMENT, cls, LX_COMMENT, HL_MLCOMMENT, cls == LC_MARK ? LA_MARK : 0);
+	// strings, and the byte after a backslash in one
+	for (int q = 0; q < lx->nquotes; q++) {
+		int in = LX_STRING + 2 * q;
+		for (int cls = 0; cls < LC_MAX; cls++) {
+			lexMoveSet(lx, in, cls, in, HL_STRING, cls == LC_MARK ? LA_MARK : 0);
+			lexMoveSet(lx, in + 1, cls, in, HL_STRING, 0);
+		}
+		lexMoveSet(lx, in, LC_QUOTE + q, LX_SEP, HL_STRING, 0);
+		lexMoveSet(lx, in, LC_BACKSLASH, in + 1, HL_STRING, 0);
+	}
+
+	char *scs = syn->singleline_comment_start;
+	char *mcs = syn->multiline_comment_start;
+	char *mce = syn->multiline_comment_end;
+	for (int st = LX_SEP; st <= LX_NUMBER; st++) {
+		if (scs && scs[0]) lexDelimAdd(lx, st, scs, HL_COMMENT, st, 1);
+		if (mcs && mcs[0] && mce && mce[0]) lexDelimAdd(lx, st, mcs, HL_MLCOMMENT, LX_COMMENT, 0);
+	}
+	if (mcs && mcs[0] && mce && mce[0]) lexDelimAdd(lx, LX_COMMENT, mce, HL_MLCOMMENT, LX_SEP, 0);
+
+	lx->keywords = keywordTableBuild(syn->keywords);
+	if (lx->keywords == NULL) {
+		free(lx);
+		return NULL;
+	}
+	return lx;
+}
+
+static int editorHighlightLine(char *s, int len, unsigned char *hl, int in_comment) {
+	// highlight len chars of s into hl, starting inside a multiline comment if
+	// in_comment is set. s doesn't have to be nul terminated, so this also runs
+	// over raw chars for rows that haven't been rendered.
+	// returns whether the line ends inside a multiline comment
+	struct lexTable *lx = E.syntax->lexer;
+
+	int state = in_comment ? LX_COMMENT : LX_SEP;
+	int i = 0;
+	while (i < len) {
+		unsigned char c = s[i];
+		const struct lexMove *m = &lx->moves[state][lx->cls[c]];
+		if (m->action == LA_MARK) {
+			// c could be where a comment marker starts
+			int d;
+			for (d = 0; d < lx->ndelims[state]; d++) {
+				struct lexDelim *dl = &lx->delims[state][d];
+				if (len - i >= dl->len && !memcmp(&s[i], dl->s, dl->len)) break;
+			}
+			if (d < lx->ndelims[state]) {
+				struct lexDelim *dl = &lx->delims[state][d];
+				int n = dl->rest ? len - i : dl->len;
+				memset(&hl[i], dl->hl, n);
+				i += n;
+				state = dl->next;
+				continue;
+			}
+			m = &lx->moves[state][lx->base[c]];
+		}
+		if (m->action == LA_WORD) {
+			// a keyword has to be the whole word, up to the next separator
+			int klen = 0;
+			while (klen < len - i && !lx->sep[(unsigned char)s[i + klen]] &&
+						 klen <= lx->keywords->maxlen)
+				klen++;
+			int kind = klen <= lx->keywords->maxlen ? keywordLookup(lx->keywords, &s[i], klen) : 0;
+			if (kind) {
+				memset(&hl[i], kind, klen);
+				i += klen;
+				state = LX_WORD;
+				continue;
+			}
+		}
+		hl[i++] = m->hl;
+		state = m->next;
+	}
+
+	return state == LX_COMMENT;
+}
+
+int editorRowOpenComment(erow *row) {
+	return row && (row->flags & ROW_OPEN_COMMENT);
+}
+
+static int editorLexRowFrom(erow *row, int in_comment, int from) {
+	// re-highlight a row given the comment state coming in from the row above
+	// and store the state it leaves behind. rows that aren't rendered only get
+	// their state worked out, nothing is kept for them.
+	// a row that hasn't changed since it was lexed from the same state is
+	// left alone. from is how many columns of hl in front of an edit are
+	// still good, if the state coming in is the same as last time
+	static unsigned char *scratch = NULL;
+	static int scratch_len = 0;
+
+	if (E.syntax == NULL) return 0;
+	int was_in = (row->flags & ROW_HL_IN) != 0;
+	if ((row->flags & ROW_HL_VALID) && was_in == in_comment) return editorRowOpenComment(row);
+
+	int open;
+	if (row->flags & ROW_UNRENDERED) {
+		if (row->size > scratch_len) {
+			scratch_len = row->size * 2;
+			scratch = realloc(scratch, scratch_len);
+		}
+		open = editorHighlightLine(row->chars, row->size, scratch, in_comment);
+	} else {
+		erender *r = editorRowDisplay(row);
+		int start = 0;
+		if (from > 0 && was_in == in_comment) {
+			// back up to a space that was plain text. no token, string or
+			// comment marker reaches across one, so lexing from right after it
+			// goes just like starting a fresh line
+			start = from;
+			while (start > 0 && !(r->hl[start - 1] == HL_NORMAL && isspace(r->render[start - 1])))
+				start--;
+		}
+		if (start > 0)
+			open = editorHighlightLine(r->render + start, r->rsize - start, r->hl + start, 0);
+		else
+			open = editorHighlightLine(r->render, r->rsize, r->hl, in_comment);
+	}
+	row->flags &= ~(ROW_OPEN_COMMENT | ROW_HL_IN);
+	row->flags |= ROW_HL_VALID;
+	if (open) row->flags |= ROW_OPEN_COMMENT;
+	if (in_comment) row->flags |= ROW_HL_IN;
+	return open;
+}
+
+int editorLexRow(erow *row, int in_comment) {
+	return editorLexRowFrom(row, in_comment, 0);
+}
+
+static void editorUpdateSyntaxFrom(erow *row, int from) {
+	// from is how many columns at the front of the row are as they were
+	if (!(row->flags & (ROW_UNRENDERED | ROW_HL_VALID))) {
+		erender *r = editorRowDisplay(row);
+		r->hl = rowGrow(r->hl, &r->hlcap, r->rsize, from);
+		memset(r->hl + from, HL_NORMAL, r->rsize - from);
+	}
+  if (E.syntax == NULL) return;
+
+	erow *prev = editorRowPrev(row);
+	int old = editorRowOpenComment(row);
+	int changed = (old != editorLexRowFrom(row, editorRowOpenComment(prev), from));
+	if (!changed) return;
+
+	// the row now ends in a different comment state, carry it down, but only
+	// as far as the bottom of the screen. whatever is left over beyond that is
+	// handed to the background pass, so typing /* costs a screenful of rows
+	// and not the whole file
+	int idx = editorRowIndex(row) + 1;
+	int end = E.rowoff + E.screenrows;
+	erow *next = editorRowNext(row);
+	while (changed && next && idx < end) {
+		old = editorRowOpenComment(next);
+		changed = (old != editorLexRow(next, editorRowOpenComment(row)));
+		row = next;
+		next = editorRowNext(row);
+		idx++;
+	}
+	if (!changed || next == NULL) return;
+
+	// row idx gets a new incoming state that hasn't been carried through
+	if (idx < E.hl_frontier) {
+		// everything from idx up to the old frontier still agrees with the
+		// state it was lexed with, the background pass can skip over it once
+		// the new state stops changing anything
+		E.hl_resume = E.hl_frontier;
+		E.hl_frontier = idx;
+	} else if (idx > E.hl_frontier && idx < E.hl_resume) {
+		E.hl_resume = idx;
+	}
+}
+
+void editorUpdateSyntax(erow *row) {
+	PROF_START(syntax);
+	editorUpdateSyntaxFrom(row, 0);
+	PROF_END(PROF_SYNTAX, syntax);
+}
+
+int editorSyntaxPending(void) {
+	return E.syntax && E.hl_frontier < E.numrows;
+}
+
+void editorSyntaxStep(erow *row, int in_comment) {
+	// lex the row at the frontier (whose row above is known good) and move the
+	// frontier past it. if the row comes out the same as before, the rows up
+	// to hl_resume were lexed from the same states already and can be skipped
+	int old = editorRowOpenComment(row);
+	int out = editorLexRow(row, in_comment);
+	E.hl_frontier++;
+	if (out == old && E.hl_frontier < E.hl_resume) E.hl_frontier = E.hl_resume;
+	if (E.hl_resume < E.hl_frontier) E.hl_resume = E.hl_frontier;
+}
+
+int editorSyntaxIdle(int budget_ms) {
+	// background pass: carry the multiline comment state forward from the
+	// frontier for budget_ms, rows behind the frontier are known good.
+	// returns 1 if the visible part of the file was touched
+	if (!editorSyntaxPending()) return 0;
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int first = E.hl_frontier;
+	int n = 0;
+	int at = -1;
+	int in_comment = 0;
+	erow *row = NULL;
+	while (E.hl_frontier < E.numrows) {
+		if (at != E.hl_frontier) {
+			// first time round or the frontier jumped ahead, find where it is now
+			at = E.hl_frontier;
+			row = editorRowAt(at);
+			erow *prev = editorRowPrev(row);
+			in_comment = editorRowOpenComment(prev);
+		}
+		editorSyntaxStep(row, in_comment);
+		in_comment = editorRowOpenComment(row);
+		row = editorRowNext(row);
+		at++;
+		if (++n % 256 == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long ms = (now.tv_sec - start.tv_sec) * 1000 +
+				(now.tv_nsec - start.tv_nsec) / 1000000;
+			if (ms >= budget_ms) break;
+		}
+	}
+	return first < E.rowoff + E.screenrows && E.hl_frontier > E.rowoff;
+}
+
+// foreground colour escapes, indexed by editorSyntaxToColor() - 30
+const char colorEscapes[10][6] = {
+	"\x1b[30m", "\x1b[31m", "\x1b[32m", "\x1b[33m", "\x1b[34m",
+	"\x1b[35m", "\x1b[36m", "\x1b[37m", "\x1b[38m", "\x1b[39m"
+};
+
+#define COLOR_ESCAPE_LEN 5
+
+int editorSyntaxToColor(int hl) {
+	switch (hl) {
+	case HL_COMMENT:
+	case HL_MLCOMMENT: return 36;
+	case HL_KEYWORD1: return 33;
+	case HL_KEYWORD2: return 32;
+	case HL_STRING: return 35;
+	case HL_NUMBER: return 31;
+	case HL_MATCH: return 34;
+	default: return 37;
+	}
+}
+
+void editorSelectSyntaxHighlight() {
+  struct editorSyntax *old = E.syntax;
+  E.syntax = NULL;
+	E.hl_frontier = 0; // everything has to be highlighted again
+	E.hl_resume = 0;
+  char *ext = E.filename ? strrchr(E.filename, '.') : NULL;
+  for (unsigned int j = 0; E.filename && !E.syntax && j < HLDB_ENTRIES; j++) {
+    struct editorSyntax *s = &HLDB[j];
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        E.syntax = s;
+        // nothing gets highlighted here, editorDrawRows does the visible
+        // rows and editorSyntaxIdle works through the rest between keypresses
+        break;
+      }
+      i++;
+    }
+  }
+	if (E.syntax && E.syntax->lexer == NULL) {
+		E.syntax->lexer = lexCompile(E.syntax);
+		if (E.syntax->lexer == NULL) E.syntax = NULL; // no memory for the tables, go without colours
+	}
+	if (E.syntax != old) {
+		// rows remember what they were lexed with, that's no good under other rules
+		// cold chunks included, without unpacking them
+		for (rowchunk *c = chunkFirst(E.rowtree); c; c = chunkNext(c))
+			for (int j = 0; j < c->count; j++) c->rows[j].flags &= ~ROW_HL_VALID;
+	}
+}
+
+/*** row operations ***/
+
+static int countTabs(const char *s, int len) {
+	// count tabs a vector at a time, the tail is done a byte at a time
+	int n = 0;
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256i tab = _mm256_set1_epi8('\t');
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&s[i]);
+		n += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab)));
+	}
+#elif defined(__SSE2__)
+	const __m128i tab = _mm_set1_epi8('\t');
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+		n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)));
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t tab = vdupq_n_u8('\t');
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)&s[i]), tab);
+		n += vaddvq_u8(vshrq_n_u8(eq, 7));
+	}
+#endif
+	for (; i < len; i++) n += (s[i] == '\t');
+	return n;
+}
+
+static int editorRowTabAt(erender *r, int cx) {
+	// index of the last tab in front of cx, or -1 if there is none
+	int lo = 0, hi = r->ntabs - 1, found = -1;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (r->tabs[mid].cx < cx) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+static int editorRowTabStart(erender *r, int i) {
+	// render column the tab at index i starts at
+	if (i == 0) return r->tabs[0].cx;
+	return r->tabs[i - 1].rx + (r->tabs[i].cx - r->tabs[i - 1].cx - 1);
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+	// compute render position, every char past the last tab in front of cx
+	// takes up exactly one column
+	editorRowRender(row);
+	erender *r = editorRowDisplay(row);
+	int i = editorRowTabAt(r, cx);
+	if (i == -1) return cx;
+	return r->tabs[i].rx + (cx - r->tabs[i].cx - 1);
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+	editorRowRender(row);
+	erender *r = editorRowDisplay(row);
+	// find the last tab starting at or before rx
+	int lo = 0, hi = r->ntabs - 1, i = -1;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (editorRowTabStart(r, mid) <= rx) {
+			i = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	int cx;
+	if (i == -1) cx = rx;
+	else if (rx < r->tabs[i].rx) cx = r->tabs[i].cx; // inside the tab
+	else cx = r->tabs[i].cx + 1 + (rx - r->tabs[i].rx);
+	return cx > row->size ? row->size : cx;
+}
+
+static void editorUpdateRowFrom(erow *row, int at) {
+	// figures out how to render the row
+	// primarily used to render tabs
+	// at is the first char that changed, whatever was highlighted in front
+	// of it doesn't have to be done again
+	erender *r = editorRowDisplay(row);
+	int keep = 0;
+	if (at > 0 && (row->flags & (ROW_UNRENDERED | ROW_HL_VALID)) == ROW_HL_VALID)
+		keep = editorRowCxToRx(row, at);
+	row->flags &= ~ROW_HL_VALID;
+	int tabs = countTabs(row->chars, row->size);
+
+	r->render = rowGrow(r->render, &r->rendercap,
+											row->size + tabs*(KILO_TAB_STOP - 1) + 1, 0);
+
+	// remember where every tab is and which column it ends at, that's all
+	// editorRowCxToRx and editorRowRxToCx need to convert positions
+	if (tabs) r->tabs = rowGrow(r->tabs, &r->tabscap, sizeof(tabstop) * tabs, 0);
+	r->ntabs = tabs;
+
+	// copy the text between tabs in one go and pad each tab with spaces
+	int idx = 0;
+	int j = 0;
+	int t = 0;
+	while (j < row->size) {
+		char *tab = t < tabs ? memchr(&row->chars[j], '\t', row->size - j) : NULL;
+		int run = (tab ? tab - row->chars : row->size) - j;
+		memcpy(&r->render[idx], &row->chars[j], run);
+		idx += run;
+		j += run;
+		if (tab) {
+			int width = KILO_TAB_STOP - (idx % KILO_TAB_STOP);
+			memset(&r->render[idx], ' ', width);
+			idx += width;
+			r->tabs[t].cx = j;
+			r->tabs[t].rx = idx;
+			t++;
+			j++;
+		}
+	}
+	r->render[idx] = '\0';
+	r->rsize = idx;
+	row->flags &= ~ROW_UNRENDERED;
+	wrapUpdateRow(row);
+	if (keep > r->rsize) keep = r->rsize;
+
+	PROF_START(syntax);
+	editorUpdateSyntaxFrom(row, keep);
+	PROF_END(PROF_SYNTAX, syntax);
+}
+
+void editorUpdateRow(erow *row) {
+	editorUpdateRowFrom(row, 0);
+}
+
+void editorRowRender(erow *row) {
+	// build render and hl for a row that was loaded lazily, called right
+	// before something actually needs them
+	if (row->flags & ROW_UNRENDERED) editorUpdateRow(row);
+}
+
+void editorRowOwn(erow *row) {
+	// give a row its own copy of chars before it gets edited, if it points
+	// into the map or a snapshot may be reading it
+	if (!(row->flags & ROW_MAPPED) && !editorSnapShared(row)) return;
+	int cap;
+	char *chars = rowAlloc(row->size + 1, &cap);
+	memcpy(chars, row->chars, row->size);
+	chars[row->size] = '\0';
+	editorSnapRetireRow(row);
+	row->chars = chars;
+	row->charscap = cap;
+	row->born = E.snap.epoch;
+	row->flags &= ~ROW_MAPPED;
+	chunkDropSnap(row->chunk);
+}
+
+static erow *editorNewRow(int at, char *chars, int charscap, size_t len, int flags) {
+	// find the chunk for the new row and shift the rows after it in that
+	// chunk over by one, the rest of the file doesn't move
+	// the slot comes back zeroed, render half included
+	erow *row = editorRowTreeInsert(at, len);
+
+	row->chars = chars;
+	row->charscap = charscap;
+	row->born = E.snap.epoch;
+	row->flags = flags;
+	wrapUpdateRow(row);
+
+	E.numrows++;
+	if (at < E.hl_frontier) E.hl_frontier++;
+	if (at < E.hl_resume) E.hl_resume++;
+	return row;
+}
+
+static erow *editorInsertLazyRow(int at, const char *s, size_t len) {
+	// a new row that isn't rendered until something needs it
+	editorUndoLog(UNDO_ROW_INSERT, at, 0, s, len);
+
+	int cap;
+	char *chars = rowAlloc(len + 1, &cap);
+	memcpy(chars, s, len);
+	chars[len] = '\0';
+
+	E.dirty++;
+	return editorNewRow(at, chars, cap, len, ROW_UNRENDERED);
+}
+
+void editorInsertRow(int at, const char *s, size_t len) {
+	// create and insert a new row
+
+	if (at < 0 || at > E.numrows) return;
+	editorUpdateRow(editorInsertLazyRow(at, s, len));
+}
+
+void editorFreeRow(erow *row) {
+	// just puts the blocks back on the arena's free lists, chars only once
+	// no snapshot can see it
+	editorSnapRetireRow(row);
+	if (row->flags & ROW_UNRENDERED) return; // nothing was built for it
+	erender *r = editorRowDisplay(row);
+	rowFree(r->render, r->rendercap);
+	rowFree(r->hl, r->hlcap);
+	rowFree(r->tabs, r->tabscap);
+}
+
+void editorRowMarkJoined(int at, int joined) {
+	// editorRowSetJoined for an edit, so it can be undone
+	erow *row = editorRowAt(at);
+	if (!(row->flags & ROW_JOINED) == !joined) return;
+	editorUndoLog(UNDO_ROW_JOINED, at, 0, "", 0);
+	editorRowSetJoined(row, joined);
+	E.dirty++;
+}
+
+void editorDelRow(int at) {
+	if (at < 0 || at >= E.numrows) return;
+	// the flag goes first, so taking the row back puts the flag back too
+	editorRowMarkJoined(at, 0);
+	erow *row = editorRowAt(at);
+	editorUndoLog(UNDO_ROW_DELETE, at, 0, row->chars, row->size);
+	editorFreeRow(row);
+	editorRowTreeDelete(at);
 	E.numrows--;
+	if (at < E.hl_frontier) E.hl_frontier--;
+	if (at < E.hl_resume) E.hl_resume--;
+	// the row that moved up has a new row above it, so its comment state may
+	// have changed
+	erow *next = editorRowAt(at);
+	if (next && E.syntax) editorUpdateSyntax(next);
+	E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+	if (at < 0 || at > row->size) at = row->size;
+	editorUndoLog(UNDO_INSERT, editorRowIndex(row), at, s, len);
+	editorRowOwn(row);
+	row->chars = rowGrow(row->chars, &row->charscap, row->size + len + 1, row->size + 1);
+	memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+	memcpy(&row->chars[at], s, len);
+	editorRowSetSize(row, row->size + len);
+	editorUpdateRowFrom(row, at);
 	E.dirty++;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-	if (at < 0 || at > row->size) at = row->size;
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	editorUpdateRow(row);
-	E.dirty++;
+void editorRowDelString(erow *row, int at, int len) {
+	if (at < 0 || at >= row->size) return;
+	if (len > row->size - at) len = row->size - at;
+	editorUndoLog(UNDO_DELETE, editorRowIndex(row), at, &row->chars[at], len);
+	editorRowOwn(row);
+	memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+	editorRowSetSize(row, row->size - len);
+	editorUpdateRowFrom(row, at);
+	E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+	char ch = c;
+	editorRowInsertString(row, at, &ch, 1);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+	editorRowInsertString(row, row->size, s, len);
+}
+
+void editorRowDelChar(erow *row, int at) {
+	editorRowDelString(row, at, 1);
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+	if (E.cy == E.numrows) {
+		editorInsertRow(E.numrows, "", 0);
+	}
+	erow *row = editorRowAt(E.cy);
+	if (row->size >= KILO_ROW_MAX) {
+		editorSetStatusMessage("Line is too long");
+		return;
+	}
+	editorRowInsertChar(row, E.cx, c);
+	E.cx++;
+}
+
+void editorInsertNewline(void) {
+	if (E.cx == 0) {
+		editorInsertRow(E.cy, "", 0);
+	} else {
+		erow *row = editorRowAt(E.cy);
+		int joined = row->flags & ROW_JOINED;
+		editorRowMarkJoined(E.cy, 0); // the second half goes on into the next row now
+		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+		if (joined) editorRowMarkJoined(E.cy + 1, 1);
+		row = editorRowAt(E.cy);
+		editorRowDelString(row, E.cx, row->size - E.cx);
+	}
+	E.cy++;
+	E.cx = 0;
+}
+
+static const char *editorLineEnd(const char *s, const char *end) {
+	while (s < end && *s != '\r' && *s != '\n') s++;
+	return s;
+}
+
+static const char *editorNextLine(const char *eol, const char *end) {
+	// step over a line break, \r\n counts as one
+	if (eol < end && *eol == '\r') eol++;
+	else if (eol < end && *eol == '\n') return eol + 1;
+	if (eol < end && *eol == '\n') eol++;
+	return eol;
+}
+
+static int editorTextFits(const char *s, size_t len) {
+	// would every row a paste makes stay under KILO_ROW_MAX, checked in one
+	// go before anything changes
+	const char *end = s + len;
+	int size = E.cy < E.numrows ? editorRowAt(E.cy)->size : 0;
+	size_t head = E.cx, tail = size - E.cx;
+	const char *eol = editorLineEnd(s, end);
+	if (eol == end) return (size_t)size + len <= KILO_ROW_MAX;
+	if (head + (eol - s) > KILO_ROW_MAX) return 0;
+	for (s = editorNextLine(eol, end); (eol = editorLineEnd(s, end)) < end; s = editorNextLine(eol, end))
+		if ((size_t)(eol - s) > KILO_ROW_MAX) return 0;
+	return (size_t)(end - s) + tail <= KILO_ROW_MAX;
+}
+
+void editorInsertText(const char *s, size_t len) {
+	// put a block of text in at the cursor, for pastes. the lines in the
+	// middle become rows directly and only get their comment state worked
+	// out, they're rendered when they first show up on screen. only the
+	// last row carries a changed state on down the file
+	if (len == 0) return;
+	const char *end = s + len;
+	const char *eol = editorLineEnd(s, end);
+	if (!editorTextFits(s, len)) {
+		editorSetStatusMessage("Paste has a line too long to fit in a row");
+		return;
+	}
+	if (E.cy == E.numrows) {
+		editorInsertRow(E.numrows, "", 0);
+	}
+	erow *row = editorRowAt(E.cy);
+	if (eol == end) {
+		editorRowInsertString(row, E.cx, s, len);
+		E.cx += len;
+		return;
+	}
+
+	// the part of the row after the cursor goes on the end of the last line,
+	// and so does a cut to a next row
+	int joined = row->flags & ROW_JOINED;
+	editorRowMarkJoined(E.cy, 0);
+	int taillen = row->size - E.cx;
+	char *tail = malloc(taillen + 1);
+	memcpy(tail, &row->chars[E.cx], taillen);
+	editorRowDelString(row, E.cx, taillen);
+	editorRowInsertString(row, E.cx, s, eol - s);
+
+	int at = E.cy + 1;
+	int in_comment = editorRowOpenComment(row);
+	s = editorNextLine(eol, end);
+	while ((eol = editorLineEnd(s, end)) < end) {
+		row = editorInsertLazyRow(at++, s, eol - s);
+		in_comment = editorLexRow(row, in_comment);
+		s = editorNextLine(eol, end);
+	}
+
+	int n = end - s;
+	tail = realloc(tail, n + taillen + 1);
+	memmove(tail + n, tail, taillen);
+	memcpy(tail, s, n);
+	editorInsertRow(at, tail, n + taillen);
+	free(tail);
+	if (joined) editorRowMarkJoined(at, 1);
+	// the rows below were re-lexed from the first line's state back when it
+	// went in, not the last one's. the last row is new so it can't tell
+	// whether its state changed, start again from the row under it
+	erow *next = editorRowAt(at + 1);
+	if (next && E.syntax) editorUpdateSyntax(next);
+	E.cy = at;
+	E.cx = n;
+}
+
+void editorDelChar(void) {
+	if (E.cy == E.numrows) return;
+	if (E.cx == 0 && E.cy == 0) return;
+
+
+	erow *row = editorRowAt(E.cy);
+	if (E.cx > 0) {
+		editorRowDelChar(row, E.cx - 1);
+		E.cx--;
+	} else {
+		erow *prev = editorRowPrev(row);
+		if (prev->flags & ROW_JOINED) {
+			// there's no newline in front to take out, the byte before it goes
+			if (prev->size > 0) editorRowDelChar(prev, prev->size - 1);
+			else editorDelRow(--E.cy);
+			return;
+		}
+		if (prev->size + row->size > KILO_ROW_MAX) {
+			editorSetStatusMessage("Line would be too long");
+			return;
+		}
+		int joined = row->flags & ROW_JOINED;
+		E.cx = prev->size;
+		editorRowAppendString(prev, row->chars, row->size);
+		editorDelRow(E.cy);
+		E.cy--;
+		if (joined) editorRowMarkJoined(E.cy, 1);
+	}
+}
+
+
+/*** undo ***/
+
+struct undoRecord {
+	int op; // undoOp
+	unsigned int group;
+	int row, pos;
+	int len; // bytes of text right after the record
+	int cx, cy; // cursor before the group, to go back to on undo
+	int acx, acy; // cursor after it, to go to on redo
+};
+
+#define UNDO_SIZE(len) (sizeof(struct undoRecord) + (len) + sizeof(int))
+
+static void undoRead(size_t at, struct undoRecord *rec) {
+	memcpy(rec, E.undo.buf + at, sizeof(*rec));
+}
+
+static size_t undoPrev(size_t at) {
+	// start of the record that ends at at
+	int size;
+	memcpy(&size, E.undo.buf + at - sizeof(int), sizeof(int));
+	return at - size;
+}
+
+static void undoWrite(size_t at, struct undoRecord *rec) {
+	// the record and its trailing size, the text is the caller's business
+	int size = UNDO_SIZE(rec->len);
+	memcpy(E.undo.buf + at, rec, sizeof(*rec));
+	memcpy(E.undo.buf + at + size - sizeof(int), &size, sizeof(int));
+}
+
+static void undoGrow(size_t need) {
+	struct undoLog *u = &E.undo;
+	if (u->len + need <= u->cap) return;
+	while (u->len + need > u->cap) u->cap = u->cap ? u->cap * 2 : 4096;
+	u->buf = realloc(u->buf, u->cap);
+}
+
+static int undoMakeRoom(size_t need) {
+	// drop the oldest groups until need more bytes fit under the limit. a
+	// bit more than that goes, so this doesn't run on every keystroke once
+	// the log is full. returns 0 if need is more than the whole limit
+	struct undoLog *u = &E.undo;
+	if (need > KILO_UNDO_LIMIT) {
+		u->len = u->cur = 0;
+		return 0;
+	}
+	if (u->len + need > KILO_UNDO_LIMIT) {
+		size_t target = u->len + need - KILO_UNDO_LIMIT + KILO_UNDO_LIMIT / 4;
+		size_t drop = 0;
+		struct undoRecord rec;
+		while (drop < u->len && drop < target) {
+			undoRead(drop, &rec);
+			unsigned int group = rec.group;
+			while (drop < u->len && rec.group == group) {
+				drop += UNDO_SIZE(rec.len);
+				if (drop < u->len) undoRead(drop, &rec);
+			}
+		}
+		memmove(u->buf, u->buf + drop, u->len - drop);
+		u->len -= drop;
+		u->cur = u->cur > drop ? u->cur - drop : 0;
+	}
+	undoGrow(need);
+	return 1;
+}
+
+static int undoJoin(struct undoRecord *last, int op, int row, int pos, int len) {
+	// can an edit go into the record before it. 1 if its text goes after
+	// the record's, -1 if it goes in front, 0 if it needs its own record
+	if (last->op != op || last->row != row || last->len + len > KILO_UNDO_COALESCE)
+		return 0;
+	if (op == UNDO_INSERT && last->pos + last->len == pos) return 1;
+	if (op == UNDO_DELETE && pos == last->pos) return 1; // delete key
+	if (op == UNDO_DELETE && pos + len == last->pos) return -1; // backspace
+	return 0;
+}
+
+static void undoJoinText(struct undoRecord *last, char *text, int where,
+												 int pos, const char *s, int len) {
+	// merge an edit undoJoin said yes to, text has room for len more bytes
+	if (where == 1) {
+		memcpy(text + last->len, s, len);
+	} else {
+		memmove(text + len, text, last->len);
+		memcpy(text, s, len);
+		last->pos = pos;
+	}
+	last->len += len;
+}
+
+void editorUndoLog(int op, int row, int pos, const char *s, int len) {
+	// note down a primitive edit, called by the row operations before they
+	// make it. typing next to the last record just makes it longer
+	struct undoLog *u = &E.undo;
+	editorJournalLog(op, row, pos, s, len); // undoing and redoing get saved too
+	if (u->replaying) return;
+	if (len == 0 && (op == UNDO_INSERT || op == UNDO_DELETE)) return;
+	u->len = u->cur; // a new edit throws away whatever could be redone
+
+	if (u->cur > 0 && (op == UNDO_INSERT || op == UNDO_DELETE) &&
+			u->len + len <= KILO_UNDO_LIMIT) {
+		size_t at = undoPrev(u->cur);
+		struct undoRecord last;
+		undoRead(at, &last);
+		int where = last.group == u->group ? undoJoin(&last, op, row, pos, len) : 0;
+		if (where) {
+			// the record is the last thing in the log, so it can just grow.
+			// the trailing size moves out of the way along with it
+			undoGrow(len);
+			undoJoinText(&last, u->buf + at + sizeof(last), where, pos, s, len);
+			undoWrite(at, &last);
+			u->len = u->cur = at + UNDO_SIZE(last.len);
+			return;
+		}
+	}
+	if (!undoMakeRoom(UNDO_SIZE(len))) return;
+	struct undoRecord rec = {op, u->group, row, pos, len, u->cx, u->cy, u->cx, u->cy};
+	undoWrite(u->len, &rec);
+	memcpy(u->buf + u->len + sizeof(rec), s, len);
+	u->len += UNDO_SIZE(len);
+	u->cur = u->len;
+}
+
+static void undoApply(struct undoRecord *rec, const char *text, int redo) {
+	// make a record's edit again, or take it back
+	int op = rec->op;
+	if (!redo) {
+		if (op == UNDO_INSERT) op = UNDO_DELETE;
+		else if (op == UNDO_DELETE) op = UNDO_INSERT;
+		else if (op == UNDO_ROW_INSERT) op = UNDO_ROW_DELETE;
+		else if (op == UNDO_ROW_DELETE) op = UNDO_ROW_INSERT;
+	}
+	switch (op) {
+	case UNDO_INSERT:
+		editorRowInsertString(editorRowAt(rec->row), rec->pos, text, rec->len);
+		break;
+	case UNDO_DELETE:
+		editorRowDelString(editorRowAt(rec->row), rec->pos, rec->len);
+		break;
+	case UNDO_ROW_INSERT:
+		editorInsertRow(rec->row, text, rec->len);
+		break;
+	case UNDO_ROW_DELETE:
+		editorDelRow(rec->row);
+		break;
+	case UNDO_ROW_JOINED:
+		editorRowMarkJoined(rec->row, !(editorRowAt(rec->row)->flags & ROW_JOINED));
+		break;
+	}
+}
+
+static void undoCursor(int cx, int cy) {
+	E.cy = cy < E.numrows ? cy : E.numrows;
+	erow *row = editorRowAt(E.cy);
+	int size = row ? row->size : 0;
+	E.cx = cx < size ? cx : size;
+}
+
+void editorUndo(void) {
+	struct undoLog *u = &E.undo;
+	if (u->cur == 0) {
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+	struct undoRecord rec;
+	undoRead(undoPrev(u->cur), &rec);
+	unsigned int group = rec.group;
+	u->replaying = 1;
+	while (u->cur > 0) {
+		size_t at = undoPrev(u->cur);
+		undoRead(at, &rec);
+		if (rec.group != group) break;
+		undoApply(&rec, u->buf + at + sizeof(rec), 0);
+		u->cur = at;
+		undoCursor(rec.cx, rec.cy);
+	}
+	u->replaying = 0;
+}
+
+void editorRedo(void) {
+	struct undoLog *u = &E.undo;
+	if (u->cur == u->len) {
+		editorSetStatusMessage("Nothing to redo");
+		return;
+	}
+	struct undoRecord rec;
+	undoRead(u->cur, &rec);
+	unsigned int group = rec.group;
+	u->replaying = 1;
+	while (u->cur < u->len) {
+		undoRead(u->cur, &rec);
+		if (rec.group != group) break;
+		undoApply(&rec, u->buf + u->cur + sizeof(rec), 1);
+		u->cur += UNDO_SIZE(rec.len);
+		undoCursor(rec.acx, rec.acy);
+	}
+	u->replaying = 0;
+}
+
+void editorUndoKey(int c) {
+	// called before each key is handled, decides if its edits join the
+	// group of the key before. runs of typing or deleting stay together,
+	// starting a new word or doing anything else starts a new group
+	struct undoLog *u = &E.undo;
+	int kind = UNDO_KIND_OTHER;
+	if (c == BACKSPACE || c == CTRL_KEY('h')) kind = UNDO_KIND_BACKSPACE;
+	else if (c == DEL_KEY) kind = UNDO_KIND_DELETE;
+	else if (c == '\t' || (c >= ' ' && c < 128 && c != '\x7f')) kind = UNDO_KIND_TYPE;
+	if (kind == UNDO_KIND_OTHER || kind != u->kind ||
+			(kind == UNDO_KIND_TYPE && isspace(c) && !isspace(u->last))) {
+		u->group++;
+	}
+	u->kind = kind;
+	u->last = c;
+	u->cx = E.cx;
+	u->cy = E.cy;
+}
+
+void editorUndoMark(void) {
+	// called after each key is handled, the cursor it left goes in the last
+	// record so redo puts it back there
+	struct undoLog *u = &E.undo;
+	if (u->cur == 0 || u->cur != u->len) return;
+	size_t at = undoPrev(u->cur);
+	struct undoRecord rec;
+	undoRead(at, &rec);
+	if (rec.group != u->group) return;
+	rec.acx = E.cx;
+	rec.acy = E.cy;
+	undoWrite(at, &rec);
+}
+
+/*** file i/o ***/
+
+static int editorWritev(int fd, struct iovec *iov, int n) {
+	// write all of iov, picking up where a short write left off
+	while (n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if (w == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		while (n > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+static int editorWriteRows(int fd, size_t *written) {
+	// stream the rows out a batch at a time, each row's chars and its newline
+	// go in as separate iovecs so nothing gets copied
+	static char newline = '\n';
+	struct iovec iov[KILO_SAVE_IOVECS];
+	int n = 0;
+	size_t total = 0;
+	for (rowchunk *c = chunkFirst(E.rowtree); c; c = chunkNext(c)) {
+		// cold chunks are unpacked into a buffer the next one reuses, so
+		// their rows go out before moving on
+		const char *text = c->cold ? chunkUnpack(c) : NULL;
+		for (int j = 0; j < c->count; j++) {
+			erow *row = &c->rows[j];
+			if (row->size > 0) {
+				iov[n].iov_base = text ? (char *)text : row->chars;
+				iov[n].iov_len = row->size;
+				n++;
+			}
+			if (text) text += row->size;
+			if (!(row->flags & ROW_JOINED)) {
+				iov[n].iov_base = &newline;
+				iov[n].iov_len = 1;
+				n++;
+			}
+			total += rowBytes(row);
+			if (n > KILO_SAVE_IOVECS - 2) {
+				if (editorWritev(fd, iov, n) == -1) return -1;
+				n = 0;
+			}
+		}
+		if (c->cold && n > 0) {
+			if (editorWritev(fd, iov, n) == -1) return -1;
+			n = 0;
+		}
+	}
+	if (editorWritev(fd, iov, n) == -1) return -1;
+	*written = total;
+	return 0;
+}
+
+#define KILO_LOAD_MAX_THREADS 8
+#define KILO_LOAD_THREAD_BYTES (4 << 20) // files smaller than this load inline
+#define KILO_LOAD_BLOCK (1 << 20) // what's read at a time from something that can't be mapped
+
+// a loader thread's share of the file, whole lines of it turned into
+// chunks that aren't in the tree yet
+struct loadPart {
+	const char *start, *end;
+	unsigned int born;
+	rowchunk **chunks;
+	int nchunks, chunkscap;
+	int rows;
+};
+
+static rowchunk *loadChunk(struct loadPart *part) {
+	// like chunkNew but safe off the UI thread, the priority comes later
+	rowchunk *c = malloc(sizeof(rowchunk));
+	if (c == NULL) die("malloc");
+	c->left = c->right = c->parent = NULL;
+	c->count = 0;
+	c->cbytes = 0;
+	c->wrap_epoch = 0; // counted by the background pass
+	c->snap = NULL;
+	c->cold = NULL;
+	c->render = NULL;
+	if (part->nchunks == part->chunkscap) {
+		part->chunkscap = part->chunkscap ? part->chunkscap * 2 : 64;
+		part->chunks = realloc(part->chunks, sizeof(rowchunk *) * part->chunkscap);
+	}
+	part->chunks[part->nchunks++] = c;
+	return c;
+}
+
+static void loadChunkDone(rowchunk *c) {
+	c->cjoined = 0;
+	for (int i = 0; i < c->count; i++) {
+		c->rows[i].wraps = 1; // until it's counted
+		c->cjoined += (c->rows[i].flags & ROW_JOINED) != 0;
+	}
+	c->cwraps = c->count;
+}
+
+static void *loadWorker(void *arg) {
+	// point a row at every line in the part, memchr does the scanning and
+	// is vectorized already
+	struct loadPart *part = arg;
+	rowchunk *c = NULL;
+	const char *p = part->start;
+	while (p < part->end) {
+		const char *nl = memchr(p, '\n', part->end - p);
+		const char *next = nl ? nl + 1 : part->end;
+		const char *eol = nl ? nl : part->end;
+		while (eol > p && eol[-1] == '\r') eol--;
+		do {
+			if (c == NULL || c->count == KILO_CHUNK_ROWS) {
+				if (c) loadChunkDone(c);
+				c = loadChunk(part);
+			}
+			size_t len = eol - p;
+			erow *row = &c->rows[c->count++];
+			row->chunk = c;
+			row->chars = (char *)p;
+			row->size = len > KILO_ROW_MAX ? KILO_ROW_MAX : len;
+			row->flags = ROW_MAPPED | ROW_UNRENDERED | (len > KILO_ROW_MAX ? ROW_JOINED : 0);
+			row->charscap = 0;
+			row->born = part->born;
+			c->cbytes += rowBytes(row);
+			part->rows++;
+			p += row->size;
+		} while (p < eol);
+		p = next;
+	}
+	if (c) loadChunkDone(c);
+	return NULL;
+}
+
+static void loadPullTree(rowchunk *c) {
+	if (c == NULL) return;
+	loadPullTree(c->left);
+	loadPullTree(c->right);
+	chunkPull(c);
+}
+
+static void loadBuildTree(struct loadPart *parts, int n) {
+	// the chunks come in file order, so the treap can be built in one pass
+	// with a stack of its right spine instead of inserting them one by one
+	rowchunk **spine = NULL;
+	int depth = 0, cap = 0;
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < parts[i].nchunks; k++) {
+			rowchunk *c = parts[i].chunks[k];
+			c->prio = chunkRandom();
+			rowchunk *last = NULL;
+			while (depth > 0 && spine[depth - 1]->prio < c->prio) last = spine[--depth];
+			c->left = last;
+			if (last) last->parent = c;
+			if (depth > 0) {
+				spine[depth - 1]->right = c;
+				c->parent = spine[depth - 1];
+			}
+			if (depth == cap) {
+				cap = cap ? cap * 2 : 64;
+				spine = realloc(spine, sizeof(rowchunk *) * cap);
+			}
+			spine[depth++] = c;
+		}
+		free(parts[i].chunks);
+	}
+	if (depth > 0) {
+		E.rowtree = spine[0];
+		loadPullTree(E.rowtree);
+	}
+	free(spine);
+}
+
+static int editorOpenMapped(int fd) {
+	// map the file and point each row straight at its line, nothing is copied
+	// and render/hl get built later for the rows that get drawn. big files
+	// are split at line boundaries and their rows built on several threads.
+	// returns -1 if the file can't be mapped so the caller can read it instead
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return -1;
+	if (E.rowtree) return -1; // only an empty buffer gets built from scratch
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return -1;
+	madvise(map, st.st_size, MADV_WILLNEED);
+	E.map = map;
+	E.maplen = st.st_size;
+	E.follow.pos = st.st_size;
+	E.follow.partial = map[st.st_size - 1] != '\n';
+
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > KILO_LOAD_MAX_THREADS) n = KILO_LOAD_MAX_THREADS;
+	if (n > st.st_size / KILO_LOAD_THREAD_BYTES) n = st.st_size / KILO_LOAD_THREAD_BYTES;
+	if (n < 1) n = 1;
+
+	struct loadPart parts[KILO_LOAD_MAX_THREADS];
+	pthread_t tids[KILO_LOAD_MAX_THREADS];
+	int started[KILO_LOAD_MAX_THREADS];
+	const char *end = map + st.st_size;
+	const char *p = map;
+	for (int i = 0; i < n; i++) {
+		const char *to = i == n - 1 ? end : map + st.st_size / n * (i + 1);
+		if (to < p) to = p;
+		if (to < end) {
+			const char *nl = memchr(to, '\n', end - to);
+			to = nl ? nl + 1 : end;
+		}
+		parts[i] = (struct loadPart){p, to, E.snap.epoch, NULL, 0, 0, 0};
+		p = to;
+	}
+	// the first part is done right here while the others run
+	for (int i = 1; i < n; i++)
+		started[i] = pthread_create(&tids[i], NULL, loadWorker, &parts[i]) == 0;
+	loadWorker(&parts[0]);
+	for (int i = 1; i < n; i++) {
+		if (started[i]) pthread_join(tids[i], NULL);
+		else loadWorker(&parts[i]);
+	}
+
+	for (int i = 0; i < n; i++) E.numrows += parts[i].rows;
+	loadBuildTree(parts, n);
+	E.wrap.next = 0;
+	return 0;
+}
+
+static void editorOpenRead(int fd) {
+	// for what can't be mapped, like a pipe: read it all in big blocks and
+	// split it the same way
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	for (;;) {
+		if (cap - len < KILO_LOAD_BLOCK) {
+			cap = cap ? cap * 2 : KILO_LOAD_BLOCK;
+			buf = realloc(buf, cap);
+			if (buf == NULL) die("realloc");
+		}
+		ssize_t n = read(fd, buf + len, cap - len);
+		if (n == 0) break;
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			die("read");
+		}
+		len += n;
+	}
+	E.follow.pos = len;
+	E.follow.partial = len > 0 && buf[len - 1] != '\n';
+
+	const char *p = buf;
+	const char *end = buf + len;
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		const char *next = nl ? nl + 1 : end;
+		const char *eol = nl ? nl : end;
+		while (eol > p && eol[-1] == '\r') eol--;
+		do {
+			size_t size = eol - p > KILO_ROW_MAX ? KILO_ROW_MAX : eol - p;
+			int linecap;
+			char *chars = rowAlloc(size + 1, &linecap);
+			memcpy(chars, p, size);
+			chars[size] = '\0';
+			erow *row = editorNewRow(E.numrows, chars, linecap, size, ROW_UNRENDERED);
+			p += size;
+			if (p < eol) editorRowSetJoined(row, 1);
+		} while (p < eol);
+		p = next;
+	}
+	free(buf);
+}
+
+void editorOpen(char *filename) {
+	free(E.filename);
+	E.filename = strdup(filename);
+
+	editorSelectSyntaxHighlight();
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) die("open");
+	if (editorOpenMapped(fd) == -1) editorOpenRead(fd);
+	close(fd);
+	E.dirty = 0;
+	editorJournalOpen();
+}
+
+void editorSave(void) {
+	if (E.filename == NULL) {
+		E.filename = editorPrompt("Save as %s (ESC to cancel)", NULL);
+		if (E.filename == NULL) {
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+	}
+
+	// write into a temp file next to the real one and rename it over the
+	// top once it's safely on disk, a crash halfway leaves the old file be.
+	// the rename only swaps the name, so rows that still point into the
+	// mapping of the old file stay good. a symlink is followed so it's the
+	// file it points at that gets replaced, not the link
+	char *path = realpath(E.filename, NULL);
+	if (path == NULL) path = strdup(E.filename);
+	size_t pathlen = strlen(path);
+	char *tmp = malloc(pathlen + 8);
+	memcpy(tmp, path, pathlen);
+	memcpy(tmp + pathlen, ".XXXXXX", 8);
+
+	size_t written = 0;
+	int fd = mkstemp(tmp);
+	if (fd != -1) {
+		struct stat st;
+		mode_t mode = stat(path, &st) == 0 ? (st.st_mode & 07777) : 0644;
+		if (fchmod(fd, mode) != -1 && editorWriteRows(fd, &written) != -1 &&
+				fsync(fd) != -1 && close(fd) != -1) {
+			fd = -1;
+			if (rename(tmp, path) != -1) {
+				// make the rename itself stick too
+				char *slash = strrchr(path, '/');
+				if (slash) slash[slash == path] = '\0'; // a file in / keeps the slash
+				int dirfd = open(slash ? path : ".", O_RDONLY);
+				if (dirfd != -1) {
+					fsync(dirfd);
+					close(dirfd);
+				}
+				free(tmp);
+				free(path);
+				E.dirty = 0;
+				editorJournalReset();
+				E.follow.pos = written; // a followed file carries on from what's saved
+				E.follow.partial = 0;
+				editorFollowRewatch();
+				editorSetStatusMessage("%zu bytes written to disk", written);
+				return;
+			}
+		}
+		int saved = errno;
+		if (fd != -1) close(fd);
+		unlink(tmp);
+		errno = saved;
+	}
+	free(tmp);
+	free(path);
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** autosave ***/
+
+#define JOURNAL_MAGIC "kilojnl1"
+#define JOURNAL_TEXT 16 // record op for the whole text, what a compaction writes
+#define JOURNAL_JOINS 17 // and the rows in it that are ROW_JOINED, as ints
+
+struct journalHeader {
+	char magic[8];
+	long long size; // of the file the journal goes on top of
+	long long mtime_sec, mtime_nsec;
+};
+
+struct journalJob {
+	char *path;
+	unsigned int gen;
+	struct journalHeader header;
+	int create; // start the journal over, header first
+	char *buf; // records to append, each an undoRecord and its text
+	size_t len;
+	struct textSnapshot *snap; // or rewrite the journal as a copy of this
+	size_t written; // the rest is set by the worker
+	int error; // errno, 0 if it all got to disk
+	int finished;
+};
+
+static long long journalNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int journalSum(unsigned int h, const void *p, size_t n) {
+	// FNV-1a, a torn or garbled record at the end of the journal fails it
+	const unsigned char *s = p;
+	for (size_t i = 0; i < n; i++) h = (h ^ s[i]) * 16777619u;
+	return h;
+}
+
+static char *journalPut(char *out, struct undoRecord *rec, const char *text) {
+	// a record as it goes on disk, with its checksum after it
+	unsigned int sum = journalSum(journalSum(2166136261u, rec, sizeof(*rec)), text, rec->len);
+	memcpy(out, rec, sizeof(*rec));
+	memcpy(out + sizeof(*rec), text, rec->len);
+	memcpy(out + sizeof(*rec) + rec->len, &sum, sizeof(sum));
+	return out + sizeof(*rec) + rec->len + sizeof(sum);
+}
+
+static int journalWrite(struct journalJob *job) {
+	// runs on the worker, returns 0 or an errno
+	size_t size = job->create || job->snap ? sizeof(job->header) : 0;
+	struct undoRecord rec;
+	size_t at;
+	size_t textlen = 0;
+	int njoins = 0;
+	if (job->snap) {
+		for (int i = 0; i < job->snap->nchunks; i++) {
+			struct snapChunk *t = job->snap->chunks[i];
+			for (int r = 0; r < t->count; r++) {
+				textlen += (size_t)t->rows[r].size + 1;
+				njoins += t->rows[r].joined;
+			}
+		}
+		size += sizeof(rec) + textlen + sizeof(unsigned int);
+		if (njoins) size += sizeof(rec) + sizeof(int) * njoins + sizeof(unsigned int);
+	} else {
+		for (at = 0; at < job->len; at += sizeof(rec) + rec.len) {
+			memcpy(&rec, job->buf + at, sizeof(rec));
+			size += sizeof(rec) + rec.len + sizeof(unsigned int);
+		}
+	}
+
+	char *out = malloc(size);
+	if (out == NULL) {
+		if (job->snap) editorSnapRelease(job->snap);
+		return ENOMEM;
+	}
+	char *p = out;
+	if (job->create || job->snap) {
+		memcpy(p, &job->header, sizeof(job->header));
+		p += sizeof(job->header);
+	}
+	if (job->snap) {
+		// every row with a newline after it, so no rows and one empty row
+		// differ. the rows stay as they were, the records after this one
+		// count on it, so joined ones are listed after it
+		char *text = malloc(textlen + 1);
+		int *joins = malloc(sizeof(int) * (njoins + 1));
+		if (text == NULL || joins == NULL) {
+			free(text);
+			free(joins);
+			free(out);
+			editorSnapRelease(job->snap);
+			return ENOMEM;
+		}
+		char *t = text;
+		int row = 0;
+		njoins = 0;
+		struct snapReader rd = {0};
+		for (int i = 0; i < job->snap->nchunks; i++) {
+			struct snapChunk *c = job->snap->chunks[i];
+			const struct snapRow *rows = editorSnapChunkRows(c, &rd);
+			for (int r = 0; r < c->count; r++, row++) {
+				memcpy(t, rows[r].chars, rows[r].size);
+				t += rows[r].size;
+				*t++ = '\n';
+				if (rows[r].joined) joins[njoins++] = row;
+			}
+		}
+		editorSnapReaderFree(&rd);
+		editorSnapRelease(job->snap);
+		struct undoRecord whole = {JOURNAL_TEXT, 0, 0, 0, (int)textlen, 0, 0, 0, 0};
+		p = journalPut(p, &whole, text);
+		if (njoins) {
+			struct undoRecord list = {JOURNAL_JOINS, 0, 0, 0, (int)(sizeof(int) * njoins), 0, 0, 0, 0};
+			p = journalPut(p, &list, (char *)joins);
+		}
+		free(text);
+		free(joins);
+	} else {
+		for (at = 0; at < job->len; at += sizeof(rec) + rec.len) {
+			memcpy(&rec, job->buf + at, sizeof(rec));
+			p = journalPut(p, &rec, job->buf + at + sizeof(rec));
+		}
+	}
+
+	// a compaction goes through a temp file so there's always a whole journal
+	char *tmp = NULL;
+	int fd;
+	if (job->snap) {
+		tmp = malloc(strlen(job->path) + 5);
+		if (tmp == NULL) {
+			free(out);
+			return ENOMEM;
+		}
+		sprintf(tmp, "%s.new", job->path);
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	} else if (job->create) {
+		fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	} else {
+		fd = open(job->path, O_WRONLY | O_APPEND);
+	}
+	int error = 0;
+	if (fd == -1) {
+		error = errno;
+	} else {
+		size_t done = 0;
+		while (done < size && error == 0) {
+			ssize_t n = write(fd, out + done, size - done);
+			if (n == -1 && errno != EINTR) error = errno;
+			else if (n > 0) done += n;
+		}
+		if (error == 0 && fdatasync(fd) == -1) error = errno;
+		close(fd);
+		if (error == 0 && tmp && rename(tmp, job->path) == -1) error = errno;
+		if (error && tmp) unlink(tmp);
+	}
+	job->written = size;
+	free(tmp);
+	free(out);
+	return error;
+}
+
+static void *journalWorker(void *arg) {
+	struct journalJob *job = arg;
+	job->error = journalWrite(job);
+	__atomic_store_n(&job->finished, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void journalGrow(size_t need) {
+	struct journalState *j = &E.journal;
+	if (j->len + need <= j->cap) return;
+	while (j->len + need > j->cap) j->cap = j->cap ? j->cap * 2 : 4096;
+	j->buf = realloc(j->buf, j->cap);
+}
+
+void editorJournalLog(int op, int row, int pos, const char *s, int len) {
+	// an edit is about to be made, from editorUndoLog. runs of typing end
+	// up in one record just like in the undo log
+	struct journalState *j = &E.journal;
+	if (j->path == NULL || j->replaying) return;
+	if (len == 0 && (op == UNDO_INSERT || op == UNDO_DELETE)) return;
+	struct undoRecord rec;
+	if (j->len > 0 && (op == UNDO_INSERT || op == UNDO_DELETE)) {
+		memcpy(&rec, j->buf + j->last, sizeof(rec));
+		int where = undoJoin(&rec, op, row, pos, len);
+		if (where) {
+			journalGrow(len);
+			undoJoinText(&rec, j->buf + j->last + sizeof(rec), where, pos, s, len);
+			memcpy(j->buf + j->last, &rec, sizeof(rec));
+			j->len += len;
+			return;
+		}
+	}
+	if (j->len == 0) j->due = journalNow() + KILO_JOURNAL_DELAY_MS;
+	journalGrow(sizeof(rec) + len);
+	rec = (struct undoRecord){op, 0, row, pos, len, 0, 0, 0, 0};
+	j->last = j->len;
+	memcpy(j->buf + j->len, &rec, sizeof(rec));
+	memcpy(j->buf + j->len + sizeof(rec), s, len);
+	j->len += sizeof(rec) + len;
+}
+
+int editorJournalTimeout(void) {
+	// how long the event loop may sleep as far as autosave is concerned
+	struct journalState *j = &E.journal;
+	if (j->job) return KILO_JOURNAL_POLL_MS;
+	if (j->path == NULL) return -1;
+	if (j->len == 0 && !j->broken) return -1;
+	long long ms = j->due - journalNow();
+	return ms > 0 ? (int)ms : 0;
+}
+
+static void journalFailed(int error) {
+	// a write didn't make it. the next try is a whole rewrite, held off a
+	// little longer every time, unless an edit comes along first. the same
+	// error over and over won't go away by itself, autosave stops then
+	struct journalState *j = &E.journal;
+	if (error != j->error || !j->broken) {
+		j->failures = 0;
+		editorSetStatusMessage("Autosave failed: %s", strerror(error));
+	}
+	j->broken = 1;
+	j->error = error;
+	j->backoff = j->backoff ? j->backoff * 2 : KILO_JOURNAL_RETRY_MS;
+	if (j->backoff > KILO_JOURNAL_RETRY_MAX_MS) j->backoff = KILO_JOURNAL_RETRY_MAX_MS;
+	j->due = journalNow() + j->backoff;
+	if (++j->failures < KILO_JOURNAL_GIVE_UP) return;
+	editorSetStatusMessage("Autosave off for this file: %s", strerror(error));
+	free(j->path);
+	j->path = NULL; // saving starts a journal again
+	j->len = 0;
+}
+
+void editorJournalPoll(void) {
+	// collect a finished write, then start the next one if it's time
+	struct journalState *j = &E.journal;
+	if (j->job) {
+		struct journalJob *job = j->job;
+		if (!__atomic_load_n(&job->finished, __ATOMIC_ACQUIRE)) return;
+		j->job = NULL;
+		if (job->gen != j->gen) {
+			// the file got saved while this was going, nothing to do with us now
+		} else if (job->error) {
+			journalFailed(job->error);
+		} else if (job->create || job->snap) {
+			j->written = job->written;
+			j->created = 1;
+			if (job->snap) {
+				j->broken = 0;
+				j->failures = 0;
+				j->backoff = 0;
+			}
+		} else {
+			j->written += job->written;
+		}
+		free(job->path);
+		free(job->buf);
+		free(job);
+	}
+	if (j->path == NULL) return;
+
+	size_t bytes = editorBufferBytes();
+	int compact = j->broken ||
+		(j->written > KILO_JOURNAL_COMPACT && j->written > 2 * bytes);
+	if (compact && bytes + E.numrows >= INT_MAX) {
+		// more than a record holds (joined rows get a newline in it too), the
+		// journal is left to grow
+		compact = 0;
+		if (j->broken) {
+			free(j->path);
+			j->path = NULL;
+			j->len = 0;
+			return;
+		}
+	}
+	if (j->broken && journalNow() < j->due) return; // still backing off
+	if (!compact && (j->len == 0 || journalNow() < j->due)) return;
+
+	struct journalJob *job = calloc(1, sizeof(struct journalJob));
+	if (job == NULL) {
+		journalFailed(ENOMEM);
+		return;
+	}
+	job->path = strdup(j->path);
+	job->gen = j->gen;
+	memcpy(job->header.magic, JOURNAL_MAGIC, sizeof(job->header.magic));
+	job->header.size = j->base_size;
+	job->header.mtime_sec = j->base_mtime.tv_sec;
+	job->header.mtime_nsec = j->base_mtime.tv_nsec;
+	if (compact) {
+		job->snap = editorSnapshot(); // the pending edits are in there already
+		j->len = 0;
+	} else {
+		job->create = !j->created;
+		job->buf = j->buf;
+		job->len = j->len;
+		j->buf = NULL;
+		j->len = j->cap = 0;
+	}
+	j->job = job;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_t tid;
+	if (pthread_create(&tid, &attr, journalWorker, job) != 0) journalWorker(job);
+	pthread_attr_destroy(&attr);
+}
+
+static char *journalPath(const char *filename) {
+	// .name.kilo-journal in the same directory as the file
+	const char *slash = strrchr(filename, '/');
+	int dirlen = slash ? slash - filename + 1 : 0;
+	char *path = malloc(strlen(filename) + 16);
+	sprintf(path, "%.*s.%s.kilo-journal", dirlen, filename, filename + dirlen);
+	return path;
+}
+
+static void journalBase(void) {
+	// remember the version of the file the journal goes on top of
+	struct journalState *j = &E.journal;
+	struct stat st;
+	if (stat(E.filename, &st) == 0) {
+		j->base_size = st.st_size;
+		j->base_mtime = st.st_mtim;
+	} else {
+		j->base_size = 0;
+		j->base_mtime = (struct timespec){0, 0};
+	}
+}
+
+static void journalWait(void) {
+	// let a write that's still going finish, it could bring the file back
+	// after it was taken away
+	struct journalState *j = &E.journal;
+	while (j->job && !__atomic_load_n(&j->job->finished, __ATOMIC_ACQUIRE)) {
+		struct timespec ts = {0, 1000000};
+		nanosleep(&ts, NULL);
+	}
+}
+
+void editorJournalReset(void) {
+	// the file on disk has everything now, the journal starts over empty
+	struct journalState *j = &E.journal;
+	journalWait();
+	free(j->path);
+	j->path = E.filename ? journalPath(E.filename) : NULL;
+	if (j->path) unlink(j->path);
+	j->len = 0;
+	j->written = 0;
+	j->created = 0;
+	j->broken = 0;
+	j->failures = 0;
+	j->backoff = 0;
+	j->gen++;
+	if (j->path) journalBase();
+}
+
+void editorJournalDiscard(void) {
+	// quitting without saving, the user doesn't want those edits back
+	struct journalState *j = &E.journal;
+	journalWait();
+	if (j->path) unlink(j->path);
+}
+
+static void journalReplaceText(const char *s, int len) {
+	while (E.numrows > 0) editorDelRow(E.numrows - 1);
+	const char *end = s + len;
+	while (s < end) {
+		const char *nl = memchr(s, '\n', end - s);
+		if (nl == NULL) nl = end;
+		editorInsertLazyRow(E.numrows, s, nl - s);
+		s = nl + 1;
+	}
+	E.hl_frontier = E.hl_resume = 0;
+}
+
+static int journalApply(struct undoRecord *rec, const char *text) {
+	// replay a record if it fits the buffer, 0 if it doesn't
+	erow *row = editorRowAt(rec->row);
+	switch (rec->op) {
+	case UNDO_INSERT:
+		if (row == NULL || rec->pos < 0 || rec->pos > row->size) return 0;
+		break;
+	case UNDO_DELETE:
+		if (row == NULL || rec->pos < 0 || rec->pos + rec->len > row->size) return 0;
+		break;
+	case UNDO_ROW_INSERT:
+		if (rec->row < 0 || rec->row > E.numrows) return 0;
+		break;
+	case UNDO_ROW_DELETE:
+	case UNDO_ROW_JOINED:
+		if (row == NULL) return 0;
+		break;
+	case JOURNAL_TEXT:
+		journalReplaceText(text, rec->len);
+		return 1;
+	case JOURNAL_JOINS:
+		for (int i = 0; i < rec->len / (int)sizeof(int); i++) {
+			int at;
+			memcpy(&at, text + sizeof(int) * i, sizeof(int));
+			if (at < 0 || at >= E.numrows) return 0;
+			editorRowMarkJoined(at, 1);
+		}
+		return 1;
+	default:
+		return 0;
+	}
+	undoApply(rec, text, 1);
+	return 1;
+}
+
+static void journalRecover(void) {
+	// replay a journal left behind by a crash, if it goes with the file as
+	// it is on disk. a torn record at the end is cut off
+	struct journalState *j = &E.journal;
+	int fd = open(j->path, O_RDWR);
+	if (fd == -1) return;
+	struct stat st;
+	char *data = NULL;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct journalHeader) ||
+			(data = malloc(st.st_size)) == NULL ||
+			pread(fd, data, st.st_size, 0) != st.st_size) {
+		free(data);
+		close(fd);
+		return;
+	}
+	struct journalHeader h;
+	memcpy(&h, data, sizeof(h));
+	if (memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) || h.size != j->base_size ||
+			h.mtime_sec != j->base_mtime.tv_sec || h.mtime_nsec != j->base_mtime.tv_nsec) {
+		editorSetStatusMessage("Ignoring the autosave journal, the file changed since");
+		free(data);
+		close(fd);
+		return;
+	}
+
+	size_t size = st.st_size;
+	size_t at = sizeof(h);
+	int n = 0;
+	struct undoRecord rec;
+	j->replaying = 1;
+	E.undo.replaying = 1;
+	while (at + sizeof(rec) + sizeof(unsigned int) <= size) {
+		memcpy(&rec, data + at, sizeof(rec));
+		if (rec.len < 0 || (size_t)rec.len > size - at - sizeof(rec) - sizeof(unsigned int)) break;
+		const char *text = data + at + sizeof(rec);
+		unsigned int sum;
+		memcpy(&sum, text + rec.len, sizeof(sum));
+		if (sum != journalSum(journalSum(2166136261u, &rec, sizeof(rec)), text, rec.len)) break;
+		if (!journalApply(&rec, text)) break;
+		at += sizeof(rec) + rec.len + sizeof(sum);
+		n++;
+		if (rec.op != JOURNAL_TEXT && rec.op != JOURNAL_JOINS) {
+			E.cy = rec.row < E.numrows ? rec.row : E.numrows;
+			E.cx = 0;
+		}
+	}
+	j->replaying = 0;
+	E.undo.replaying = 0;
+	if (ftruncate(fd, at) == 0) {
+		j->written = at;
+		j->created = 1;
+	}
+	close(fd);
+	free(data);
+	if (n) editorSetStatusMessage("Recovered %d edits from the autosave journal, save to keep them", n);
+}
+
+void editorJournalOpen(void) {
+	// a file was just loaded, pick up its journal if there is one
+	struct journalState *j = &E.journal;
+	free(j->path);
+	j->path = journalPath(E.filename);
+	j->len = 0;
+	j->written = 0;
+	j->created = 0;
+	j->broken = 0;
+	j->failures = 0;
+	j->backoff = 0;
+	j->gen++;
+	journalBase();
+	journalRecover();
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-	row->chars = realloc(row->chars, row->size + len + 1);
+/*** follow ***/
+
+static void followWatch(void) {
+	E.follow.fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+	E.follow.ifd = -1;
+#ifdef __linux__
+	if (E.follow.fd == -1) return;
+	E.follow.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (E.follow.ifd == -1) return;
+	E.follow.wd = inotify_add_watch(E.follow.ifd, E.filename,
+		IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	if (E.follow.wd == -1) {
+		close(E.follow.ifd);
+		E.follow.ifd = -1;
+	}
+#endif
+}
+
+static void followUnwatch(void) {
+	if (E.follow.ifd != -1) close(E.follow.ifd);
+	if (E.follow.fd != -1) close(E.follow.fd);
+	E.follow.ifd = E.follow.fd = -1;
+}
+
+void editorFollowRewatch(void) {
+	// saving renames a new file over the old one, watch that instead
+	if (!E.follow.on) return;
+	followUnwatch();
+	followWatch();
+}
+
+void editorFollowToggle(void) {
+	if (E.follow.on) {
+		followUnwatch();
+		E.follow.on = 0;
+		editorSetStatusMessage("Stopped following");
+		return;
+	}
+	if (E.filename == NULL) {
+		editorSetStatusMessage("No file to follow");
+		return;
+	}
+	followWatch();
+	if (E.follow.fd == -1) {
+		editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+		return;
+	}
+	// a log gets truncated when it's rotated, and reading a mapping past the
+	// end of the file kills us, so the rows get their own copies first
+	if (E.map) {
+		// cold chunks have nothing in the map
+		for (rowchunk *c = chunkFirst(E.rowtree); c; c = chunkNext(c))
+			for (int j = 0; !c->cold && j < c->count; j++) editorRowOwn(&c->rows[j]);
+		snapRetire(E.map, E.maplen, -1); // a search may still be reading it
+		E.map = NULL;
+		E.maplen = 0;
+	}
+	E.follow.on = 1;
+	E.follow.backlog = 1; // catch up with whatever was written since it was opened
+	E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+	E.cx = 0;
+	editorSetStatusMessage("Following %s (Ctrl-T to stop)", E.filename);
+}
+
+int editorFollowFd(void) {
+	return E.follow.on ? E.follow.ifd : -1;
+}
+
+int editorFollowTimeout(void) {
+	// how long the event loop may sleep as far as follow mode is concerned
+	if (!E.follow.on) return -1;
+	if (E.follow.ifd == -1) return KILO_FOLLOW_POLL_MS;
+	if (E.follow.backlog) return 0;
+	return -1;
+}
+
+static void followExtendRow(erow *row, const char *s, size_t len) {
+	// the last row is still being written, its new part goes on the end
+	editorRowOwn(row);
+	row->chars = rowGrow(row->chars, &row->charscap, row->size + len + 1, row->size + 1);
 	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
+	editorRowSetSize(row, row->size + len);
 	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+	// render it again when it's drawn, and its comment state needs redoing
+	row->flags |= ROW_UNRENDERED;
+	row->flags &= ~ROW_HL_VALID;
+	int at = E.numrows - 1;
+	if (at < E.hl_frontier) E.hl_frontier = at;
 }
 
-void editorRowDelChar(erow *row, int at) {
-	if (at < 0 || at >= row->size) return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
+static void followAppend(const char *s, size_t len) {
+	// split what came in into rows at the end of the buffer. they aren't
+	// rendered until they're drawn and the background pass works out their
+	// comment state, the rows that were already there aren't touched
+	const char *end = s + len;
+	if (E.follow.partial && E.numrows > 0) {
+		const char *nl = memchr(s, '\n', len);
+		const char *eol = nl ? nl : end;
+		erow *row = editorRowAt(E.numrows - 1);
+		while ((size_t)(eol - s) > (size_t)(KILO_ROW_MAX - row->size)) {
+			// fill the row up and go on in a new one
+			int room = KILO_ROW_MAX - row->size;
+			followExtendRow(row, s, room);
+			editorRowSetJoined(row, 1);
+			wrapUpdateRow(row);
+			s += room;
+			int cap;
+			char *chars = rowAlloc(1, &cap);
+			chars[0] = '\0';
+			row = editorNewRow(E.numrows, chars, cap, 0, ROW_UNRENDERED);
+		}
+		followExtendRow(row, s, eol - s);
+		if (nl) {
+			int size = row->size;
+			while (size > 0 && row->chars[size - 1] == '\r') size--;
+			editorRowSetSize(row, size);
+			row->chars[size] = '\0';
+		}
+		wrapUpdateRow(row);
+		s = nl ? nl + 1 : end;
+		E.follow.partial = nl == NULL;
+	}
+	while (s < end) {
+		const char *nl = memchr(s, '\n', end - s);
+		const char *eol = nl ? nl : end;
+		if (nl) while (eol > s && eol[-1] == '\r') eol--;
+		do {
+			size_t size = eol - s > KILO_ROW_MAX ? KILO_ROW_MAX : eol - s;
+			int cap;
+			char *chars = rowAlloc(size + 1, &cap);
+			memcpy(chars, s, size);
+			chars[size] = '\0';
+			erow *row = editorNewRow(E.numrows, chars, cap, size, ROW_UNRENDERED);
+			s += size;
+			if (s < eol) editorRowSetJoined(row, 1);
+		} while (s < eol);
+		E.follow.partial = nl == NULL;
+		s = nl ? nl + 1 : end;
+	}
 }
 
-/*** editor operations ***/
+int editorFollowPoll(int ready) {
+	// read what was added to the file since last time, a slice at a time so
+	// a fast writer can't hold up the keyboard. returns 1 if anything changed
+	static char *buf = NULL;
+	struct followState *f = &E.follow;
+	if (!f->on) return 0;
+
+#ifdef __linux__
+	if (ready) {
+		char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t n;
+		while ((n = read(f->ifd, ev, sizeof(ev))) > 0) {
+			for (char *p = ev; p < ev + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+				struct inotify_event *e = (struct inotify_event *)p;
+				if (e->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+					// rotated away, wait for a new file to show up under the name
+					followUnwatch();
+				}
+			}
+		}
+	}
+#endif
+	// with inotify there's nothing to do unless it said so
+	if (!ready && !f->backlog && f->ifd != -1) return 0;
+
+	if (f->fd == -1) {
+		followWatch();
+		if (f->fd == -1) return 0;
+		f->pos = 0;
+		f->partial = 0;
+		f->backlog = 1;
+		editorSetStatusMessage("%s was replaced, following the new file", E.filename);
+	}
+	struct stat st;
+	if (fstat(f->fd, &st) == -1) return 0;
+	if (st.st_size < f->pos) {
+		editorSetStatusMessage("%s was truncated", E.filename);
+		f->pos = 0;
+		f->partial = 0;
+	}
+	f->backlog = 0;
+	if (st.st_size == f->pos) return 0;
+
+	if (buf == NULL) buf = malloc(KILO_FOLLOW_READ);
+	size_t want = st.st_size - f->pos;
+	if (want > KILO_FOLLOW_READ) want = KILO_FOLLOW_READ;
+	ssize_t n = pread(f->fd, buf, want, f->pos);
+	if (n <= 0) return 0;
+	f->pos += n;
+	f->backlog = f->pos < st.st_size;
+
+	// stick to the bottom if that's where the cursor is
+	int pinned = E.cy >= E.numrows - 1;
+	followAppend(buf, n);
+	if (pinned && E.numrows > 0 && E.cy != E.numrows - 1) {
+		E.cy = E.numrows - 1;
+		E.cx = 0;
+	}
+	return 1;
+}
 
-void editorInsertChar(int c) {
-	if (E.cy == E.numrows) {
-		editorInsertRow(E.numrows, "", 0);
+/*** regex ***/
+
+/* regex search compiles the pattern to a Thompson NFA and runs it as a lazy
+ * DFA: each DFA state is the set of NFA states the scan can be in, worked out
+ * the first time a row needs it and cached from then on. nothing backtracks,
+ * so a row costs time linear in its length whatever the pattern is, and the
+ * cache is flushed when it fills up so a pattern with a huge DFA can't eat
+ * memory either. the syntax is the usual . [] [^] * + ? {n,m} | () ^ $ with
+ * \d \w \s (and \D \W \S) as classes. matching is leftmost-longest */
+
+#define KILO_REGEX_MAX_NFA 8192 // patterns that compile to more states are refused
+#define KILO_REGEX_MAX_REPEAT 1000
+#define KILO_REGEX_MAX_DEPTH 200 // nested groups
+#define KILO_REGEX_DFA_STATES 2048 // lazy DFA states cached before a flush
+
+enum reNodeType { RE_CLASS, RE_BOL, RE_EOL, RE_EMPTY, RE_CAT, RE_ALT, RE_REPEAT };
+
+struct reNode {
+	int type;
+	int a, b; // children, as indexes into the parser's nodes
+	int min, max; // RE_REPEAT bounds, max is -1 for no limit
+	unsigned char set[32]; // RE_CLASS: a bit for every byte that matches
+};
+
+struct reParser {
+	const char *p, *end;
+	struct reNode *nodes;
+	int n, cap;
+	int depth;
+	const char *error;
+};
+
+enum reOp { RS_CLASS, RS_SPLIT, RS_BOL, RS_EOL, RS_MATCH };
+
+struct reState {
+	int op;
+	int out, out1; // next states, out1 only for RS_SPLIT (-1 if it's a jump)
+	int set; // RS_CLASS: index into the regex's sets
+};
+
+// a compiled pattern. it is never changed after regexCompile, so threads
+// can share one, each running it with their own DFA caches
+struct regex {
+	int refs;
+	struct reState *states;
+	int nstates, cap;
+	unsigned char (*sets)[32];
+	int nsets;
+	int start; // the pattern
+	int rstart; // the pattern backwards, to find where matches start
+	unsigned char classof[256]; // bytes no class tells apart share a column
+	int nclasses;
+};
+
+#define RE_MATCH 1 // a match ends here
+#define RE_MATCH_AT_END 2 // a match ends here if this is the end of the row
+#define RE_DEAD 4 // no match can come out of this state any more
+
+struct reDFA {
+	struct regex *re;
+	int start; // the NFA state the program starts at
+	int unanchored; // matches may start anywhere, not just where the scan does
+	int n; // states in the cache
+	int *setoff, *setlen; // each state's NFA states, in pool
+	unsigned char *flags;
+	int *pool;
+	int pooln, poolcap;
+	int *next; // n * nclasses transitions, -1 until worked out
+	int *hash; // state ids by set, open addressing, -1 for empty slots
+	int hashcap;
+	int startstate[2]; // when starting at the start of a row or not
+	int flushes;
+	int *mark; // per NFA state, gen if visited by the current closure
+	int gen;
+	int *stack;
+	int *buf; // NFA states of the set being built
+	int nbuf;
+};
+
+struct textSpan {
+	int start;
+	int len;
+};
+
+struct regexMatcher {
+	struct regex *re;
+	struct reDFA fwd; // pattern, anchored where a match starts
+	struct reDFA rev; // pattern backwards, unanchored: finds every start
+	unsigned char *starts;
+	int startscap;
+};
+
+static int reNewNode(struct reParser *ps, int type) {
+	if (ps->n == ps->cap) {
+		ps->cap = ps->cap ? ps->cap * 2 : 32;
+		ps->nodes = realloc(ps->nodes, sizeof(struct reNode) * ps->cap);
 	}
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+	struct reNode *node = &ps->nodes[ps->n];
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->a = node->b = -1;
+	return ps->n++;
 }
 
-void editorInsertNewline(void) {
-	if (E.cx == 0) {
-		editorInsertRow(E.cy, "", 0);
-	} else {
-		erow *row = &E.row[E.cy];
-		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+static void reSetAdd(unsigned char *set, int c) {
+	set[c >> 3] |= 1 << (c & 7);
+}
+
+static int reSetHas(const unsigned char *set, int c) {
+	return set[c >> 3] & (1 << (c & 7));
+}
+
+static int reEscapeSet(int c, unsigned char *set) {
+	// the class escapes, returns 0 if c isn't one
+	int lower = tolower(c);
+	if (lower != 'd' && lower != 'w' && lower != 's') return 0;
+	unsigned char tmp[32] = {0};
+	int i;
+	for (i = 0; i < 256; i++) {
+		if ((lower == 'd' && isdigit(i)) || (lower == 's' && isspace(i)) ||
+				(lower == 'w' && (isalnum(i) || i == '_')))
+			reSetAdd(tmp, i);
 	}
-	E.cy++;
-	E.cx = 0;
+	for (i = 0; i < 32; i++) set[i] |= (c == lower) ? tmp[i] : (unsigned char)~tmp[i];
+	return 1;
 }
 
-void editorDelChar(void) {
-	if (E.cy == E.numrows) return;
-	if (E.cx == 0 && E.cy == 0) return;
+static int reEscapeChar(int c) {
+	switch (c) {
+	case 't': return '\t';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	default: return c;
+	}
+}
 
+static int reParseAlt(struct reParser *ps);
 
-	erow *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		editorRowDelChar(row, E.cx - 1);
-		E.cx--;
+static int reParseClass(struct reParser *ps) {
+	// [...] with the opening bracket already eaten
+	int node = reNewNode(ps, RE_CLASS);
+	unsigned char set[32] = {0};
+	int negate = 0;
+	if (ps->p < ps->end && *ps->p == '^') {
+		negate = 1;
+		ps->p++;
+	}
+	int first = 1;
+	while (ps->p < ps->end && (*ps->p != ']' || first)) {
+		first = 0;
+		int lo = (unsigned char)*ps->p++;
+		if (lo == '\\' && ps->p < ps->end) {
+			lo = (unsigned char)*ps->p++;
+			if (reEscapeSet(lo, set)) continue;
+			lo = reEscapeChar(lo);
+		}
+		int hi = lo;
+		if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+			hi = (unsigned char)ps->p[1];
+			ps->p += 2;
+			if (hi == '\\' && ps->p < ps->end) hi = reEscapeChar((unsigned char)*ps->p++);
+			if (hi < lo) {
+				ps->error = "bad range";
+				return -1;
+			}
+		}
+		for (; lo <= hi; lo++) reSetAdd(set, lo);
+	}
+	if (ps->p == ps->end) {
+		ps->error = "missing ]";
+		return -1;
+	}
+	ps->p++;
+	int i;
+	for (i = 0; i < 32; i++) ps->nodes[node].set[i] = negate ? ~set[i] : set[i];
+	return node;
+}
+
+static int reParseAtom(struct reParser *ps) {
+	int c = (unsigned char)*ps->p++;
+	int node;
+	switch (c) {
+	case '(':
+		if (++ps->depth > KILO_REGEX_MAX_DEPTH) {
+			ps->error = "too deeply nested";
+			return -1;
+		}
+		node = reParseAlt(ps);
+		ps->depth--;
+		if (node == -1) return -1;
+		if (ps->p == ps->end || *ps->p != ')') {
+			ps->error = "missing )";
+			return -1;
+		}
+		ps->p++;
+		return node;
+	case '[':
+		return reParseClass(ps);
+	case '^':
+		return reNewNode(ps, RE_BOL);
+	case '$':
+		return reNewNode(ps, RE_EOL);
+	case '*': case '+': case '?':
+		ps->error = "nothing to repeat";
+		return -1;
+	}
+	node = reNewNode(ps, RE_CLASS);
+	unsigned char *set = ps->nodes[node].set;
+	if (c == '.') {
+		memset(set, 0xff, 32);
+	} else if (c == '\\') {
+		if (ps->p == ps->end) {
+			ps->error = "trailing \\";
+			return -1;
+		}
+		c = (unsigned char)*ps->p++;
+		if (!reEscapeSet(c, set)) reSetAdd(set, reEscapeChar(c));
 	} else {
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
+		reSetAdd(set, c);
+	}
+	return node;
+}
+
+static int reParseCount(struct reParser *ps, int *min, int *max) {
+	// {n}, {n,} or {n,m}. returns 0 and leaves ps alone if it isn't one,
+	// then the brace is just a character
+	const char *p = ps->p + 1;
+	int n = 0, m;
+	if (p == ps->end || !isdigit((unsigned char)*p)) return 0;
+	for (; p < ps->end && isdigit((unsigned char)*p); p++) n = n > KILO_REGEX_MAX_REPEAT ? n : n * 10 + *p - '0';
+	m = n;
+	if (p < ps->end && *p == ',') {
+		p++;
+		m = -1;
+		if (p < ps->end && isdigit((unsigned char)*p)) {
+			for (m = 0; p < ps->end && isdigit((unsigned char)*p); p++)
+				m = m > KILO_REGEX_MAX_REPEAT ? m : m * 10 + *p - '0';
+		}
+	}
+	if (p == ps->end || *p != '}') return 0;
+	ps->p = p + 1;
+	*min = n;
+	*max = m;
+	return 1;
+}
+
+static int reParseRepeat(struct reParser *ps) {
+	int node = reParseAtom(ps);
+	while (node != -1 && ps->p < ps->end) {
+		int min, max;
+		int c = *ps->p;
+		if (c == '*') {
+			min = 0; max = -1;
+		} else if (c == '+') {
+			min = 1; max = -1;
+		} else if (c == '?') {
+			min = 0; max = 1;
+		} else if (c != '{' || !reParseCount(ps, &min, &max)) {
+			break;
+		}
+		if (c != '{') ps->p++;
+		if (min > KILO_REGEX_MAX_REPEAT || max > KILO_REGEX_MAX_REPEAT ||
+				(max != -1 && max < min)) {
+			ps->error = "bad repeat count";
+			return -1;
+		}
+		int rep = reNewNode(ps, RE_REPEAT);
+		ps->nodes[rep].a = node;
+		ps->nodes[rep].min = min;
+		ps->nodes[rep].max = max;
+		node = rep;
+	}
+	return node;
+}
+
+static int reParseCat(struct reParser *ps) {
+	int node = reNewNode(ps, RE_EMPTY);
+	while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+		int next = reParseRepeat(ps);
+		if (next == -1) return -1;
+		int cat = reNewNode(ps, RE_CAT);
+		ps->nodes[cat].a = node;
+		ps->nodes[cat].b = next;
+		node = cat;
+	}
+	return node;
+}
+
+static int reParseAlt(struct reParser *ps) {
+	int node = reParseCat(ps);
+	while (node != -1 && ps->p < ps->end && *ps->p == '|') {
+		ps->p++;
+		int next = reParseCat(ps);
+		if (next == -1) return -1;
+		int alt = reNewNode(ps, RE_ALT);
+		ps->nodes[alt].a = node;
+		ps->nodes[alt].b = next;
+		node = alt;
+	}
+	return node;
+}
+
+static int reNewState(struct regex *re, int op, int out, int out1) {
+	if (re->nstates == KILO_REGEX_MAX_NFA) return -1;
+	if (re->nstates == re->cap) {
+		re->cap = re->cap ? re->cap * 2 : 64;
+		re->states = realloc(re->states, sizeof(struct reState) * re->cap);
+	}
+	struct reState *st = &re->states[re->nstates];
+	st->op = op;
+	st->out = out;
+	st->out1 = out1;
+	st->set = -1;
+	return re->nstates++;
+}
+
+static int reCompile(struct regex *re, struct reParser *ps, int node, int next, int reversed) {
+	// build the states for node in front of next, which is where the NFA
+	// goes once node has matched. returns node's first state, -1 if the
+	// pattern got too big. backwards, concatenations run the other way and
+	// the two anchors swap
+	if (next == -1) return -1;
+	struct reNode *nd = &ps->nodes[node];
+	int s, i;
+	switch (nd->type) {
+	case RE_EMPTY:
+		return next;
+	case RE_CLASS:
+		s = reNewState(re, RS_CLASS, next, -1);
+		if (s == -1) return -1;
+		re->sets = realloc(re->sets, sizeof(re->sets[0]) * (re->nsets + 1));
+		memcpy(re->sets[re->nsets], nd->set, 32);
+		re->states[s].set = re->nsets++;
+		return s;
+	case RE_BOL:
+		return reNewState(re, reversed ? RS_EOL : RS_BOL, next, -1);
+	case RE_EOL:
+		return reNewState(re, reversed ? RS_BOL : RS_EOL, next, -1);
+	case RE_CAT:
+		if (reversed) return reCompile(re, ps, nd->b, reCompile(re, ps, nd->a, next, 1), 1);
+		return reCompile(re, ps, nd->a, reCompile(re, ps, nd->b, next, 0), 0);
+	case RE_ALT: {
+		int a = reCompile(re, ps, nd->a, next, reversed);
+		int b = reCompile(re, ps, nd->b, next, reversed);
+		if (a == -1 || b == -1) return -1;
+		return reNewState(re, RS_SPLIT, a, b);
+	}
+	case RE_REPEAT: {
+		int a = nd->a, min = nd->min, max = nd->max;
+		int cur = next;
+		if (max == -1) {
+			// a loop: split into another go at the child or on to next
+			s = reNewState(re, RS_SPLIT, -1, next);
+			if (s == -1) return -1;
+			int body = reCompile(re, ps, a, s, reversed);
+			if (body == -1) return -1;
+			re->states[s].out = body;
+			cur = s;
+		} else {
+			for (i = min; i < max && cur != -1; i++) {
+				int body = reCompile(re, ps, a, cur, reversed);
+				cur = body == -1 ? -1 : reNewState(re, RS_SPLIT, body, next);
+			}
+		}
+		for (i = 0; i < min && cur != -1; i++) cur = reCompile(re, ps, a, cur, reversed);
+		return cur;
+	}
+	}
+	return -1;
+}
+
+static void reByteClasses(struct regex *re) {
+	// split the bytes into classes that every set either has all of or none
+	// of, the DFA then needs a column per class instead of one per byte
+	memset(re->classof, 0, sizeof(re->classof));
+	re->nclasses = 1;
+	int i, c;
+	for (i = 0; i < re->nsets; i++) {
+		int inmap[256], outmap[256];
+		int n = 0;
+		for (c = 0; c < re->nclasses; c++) inmap[c] = outmap[c] = -1;
+		for (c = 0; c < 256; c++) {
+			int *map = reSetHas(re->sets[i], c) ? inmap : outmap;
+			if (map[re->classof[c]] == -1) map[re->classof[c]] = n++;
+			re->classof[c] = map[re->classof[c]];
+		}
+		re->nclasses = n;
+	}
+}
+
+struct regex *regexCompile(const char *pattern, int len, const char **error) {
+	struct reParser ps = {pattern, pattern + len, NULL, 0, 0, 0, NULL};
+	int root = reParseAlt(&ps);
+	if (root != -1 && ps.p != ps.end) ps.error = "unmatched )";
+	if (ps.error) {
+		free(ps.nodes);
+		*error = ps.error;
+		return NULL;
+	}
+	struct regex *re = calloc(1, sizeof(struct regex));
+	re->refs = 1;
+	re->start = reCompile(re, &ps, root, reNewState(re, RS_MATCH, -1, -1), 0);
+	re->rstart = reCompile(re, &ps, root, reNewState(re, RS_MATCH, -1, -1), 1);
+	free(ps.nodes);
+	if (re->start == -1 || re->rstart == -1) {
+		free(re->states);
+		free(re->sets);
+		free(re);
+		*error = "pattern too big";
+		return NULL;
+	}
+	reByteClasses(re);
+	return re;
+}
+
+void regexRelease(struct regex *re) {
+	if (!re || __atomic_sub_fetch(&re->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	free(re->states);
+	free(re->sets);
+	free(re);
+}
+
+static void reDFAFlush(struct reDFA *d) {
+	d->n = 0;
+	d->pooln = 0;
+	memset(d->hash, 0xff, sizeof(int) * d->hashcap);
+	d->startstate[0] = d->startstate[1] = -1;
+	d->flushes++;
+}
+
+static void reDFAInit(struct reDFA *d, struct regex *re, int start, int unanchored) {
+	memset(d, 0, sizeof(*d));
+	d->re = re;
+	d->start = start;
+	d->unanchored = unanchored;
+	d->setoff = malloc(sizeof(int) * KILO_REGEX_DFA_STATES);
+	d->setlen = malloc(sizeof(int) * KILO_REGEX_DFA_STATES);
+	d->flags = malloc(KILO_REGEX_DFA_STATES);
+	d->next = malloc(sizeof(int) * KILO_REGEX_DFA_STATES * re->nclasses);
+	d->hashcap = KILO_REGEX_DFA_STATES * 2;
+	d->hash = malloc(sizeof(int) * d->hashcap);
+	d->mark = calloc(re->nstates, sizeof(int));
+	d->stack = malloc(sizeof(int) * (re->nstates * 2 + 1));
+	d->buf = malloc(sizeof(int) * re->nstates);
+	reDFAFlush(d);
+}
+
+static void reDFAFree(struct reDFA *d) {
+	free(d->setoff);
+	free(d->setlen);
+	free(d->flags);
+	free(d->pool);
+	free(d->next);
+	free(d->hash);
+	free(d->mark);
+	free(d->stack);
+	free(d->buf);
+}
+
+static int reClosure(struct reDFA *d, int s, int bol, int eol, int keep) {
+	// follow the empty edges out of s. the anchors only let us through at a
+	// row's start or end. with keep, the states that wait on a byte (or on
+	// the end of the row) go into buf. returns 1 if s reaches a match
+	struct reState *states = d->re->states;
+	int sp = 0, match = 0;
+	d->stack[sp++] = s;
+	while (sp > 0) {
+		s = d->stack[--sp];
+		if (s == -1 || d->mark[s] == d->gen) continue;
+		d->mark[s] = d->gen;
+		switch (states[s].op) {
+		case RS_SPLIT:
+			// only a state's first visit pushes anything, so the stack
+			// never holds more than two entries per state
+			d->stack[sp++] = states[s].out1;
+			d->stack[sp++] = states[s].out;
+			break;
+		case RS_BOL:
+			if (bol) d->stack[sp++] = states[s].out;
+			break;
+		case RS_EOL:
+			if (eol) d->stack[sp++] = states[s].out;
+			else if (keep) d->buf[d->nbuf++] = s;
+			break;
+		case RS_MATCH:
+			match = 1;
+			/* fall through */
+		default:
+			if (keep) d->buf[d->nbuf++] = s;
+			break;
+		}
+	}
+	return match;
+}
+
+static int reCompareInt(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static int reIntern(struct reDFA *d) {
+	// the DFA state for the NFA states in buf, made if it doesn't exist yet
+	qsort(d->buf, d->nbuf, sizeof(int), reCompareInt);
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < d->nbuf; i++) h = (h ^ d->buf[i]) * 16777619u;
+	int slot = h % d->hashcap;
+	for (; d->hash[slot] != -1; slot = (slot + 1) % d->hashcap) {
+		int id = d->hash[slot];
+		if (d->setlen[id] == d->nbuf &&
+				!memcmp(&d->pool[d->setoff[id]], d->buf, sizeof(int) * d->nbuf))
+			return id;
+	}
+	if (d->n == KILO_REGEX_DFA_STATES) {
+		reDFAFlush(d);
+		return reIntern(d);
+	}
+	int id = d->n++;
+	if (d->pooln + d->nbuf > d->poolcap) {
+		while (d->pooln + d->nbuf > d->poolcap) d->poolcap = d->poolcap ? d->poolcap * 2 : 256;
+		d->pool = realloc(d->pool, sizeof(int) * d->poolcap);
+	}
+	memcpy(&d->pool[d->pooln], d->buf, sizeof(int) * d->nbuf);
+	d->setoff[id] = d->pooln;
+	d->setlen[id] = d->nbuf;
+	d->pooln += d->nbuf;
+	d->hash[slot] = id;
+	memset(&d->next[id * d->re->nclasses], 0xff, sizeof(int) * d->re->nclasses);
+
+	unsigned char flags = 0;
+	int *set = &d->pool[d->setoff[id]];
+	d->gen++;
+	for (i = 0; i < d->nbuf; i++) {
+		struct reState *st = &d->re->states[set[i]];
+		if (st->op == RS_MATCH) flags |= RE_MATCH | RE_MATCH_AT_END;
+		else if (st->op == RS_EOL && reClosure(d, st->out, 0, 1, 0)) flags |= RE_MATCH_AT_END;
+	}
+	if (d->nbuf == 0 && !d->unanchored) flags |= RE_DEAD;
+	d->flags[id] = flags;
+	return id;
+}
+
+static int reStart(struct reDFA *d, int bol) {
+	if (d->startstate[bol] == -1) {
+		d->gen++;
+		d->nbuf = 0;
+		reClosure(d, d->start, bol, 0, 1);
+		int id = reIntern(d);
+		d->startstate[bol] = id;
+	}
+	return d->startstate[bol];
+}
+
+static int reStep(struct reDFA *d, int state, int c) {
+	int *next = &d->next[state * d->re->nclasses + d->re->classof[c]];
+	if (*next != -1) return *next;
+	struct regex *re = d->re;
+	int *set = &d->pool[d->setoff[state]];
+	int i, n = d->setlen[state];
+	d->gen++;
+	d->nbuf = 0;
+	for (i = 0; i < n; i++) {
+		struct reState *st = &re->states[set[i]];
+		if (st->op == RS_CLASS && reSetHas(re->sets[st->set], c))
+			reClosure(d, st->out, 0, 0, 1);
+	}
+	if (d->unanchored) reClosure(d, d->start, 0, 0, 1);
+	int flushes = d->flushes;
+	int to = reIntern(d);
+	// a flush throws out state too, then there's nowhere to note the edge
+	if (d->flushes == flushes) d->next[state * re->nclasses + re->classof[c]] = to;
+	return to;
+}
+
+struct regexMatcher *regexMatcherNew(struct regex *re) {
+	struct regexMatcher *mt = calloc(1, sizeof(struct regexMatcher));
+	__atomic_add_fetch(&re->refs, 1, __ATOMIC_RELAXED);
+	mt->re = re;
+	reDFAInit(&mt->fwd, re, re->start, 0);
+	reDFAInit(&mt->rev, re, re->rstart, 1);
+	return mt;
+}
+
+void regexMatcherFree(struct regexMatcher *mt) {
+	if (!mt) return;
+	reDFAFree(&mt->fwd);
+	reDFAFree(&mt->rev);
+	free(mt->starts);
+	regexRelease(mt->re);
+	free(mt);
+}
+
+int regexScan(struct regexMatcher *mt, const char *s, int len,
+							struct textSpan **hits, int *cap) {
+	// every match in s, leftmost-longest and not overlapping, into hits.
+	// the pattern runs backwards over the row once to mark every place a
+	// match starts, then forwards from each start to find where it ends
+	if (len == 0) return 0;
+	if (len > mt->startscap) {
+		mt->startscap = len * 2;
+		mt->starts = realloc(mt->starts, mt->startscap);
+	}
+	unsigned char *starts = mt->starts;
+	int any = 0;
+	int i;
+	int state = reStart(&mt->rev, 1);
+	for (i = len - 1; i >= 0; i--) {
+		state = reStep(&mt->rev, state, (unsigned char)s[i]);
+		int flags = mt->rev.flags[state];
+		starts[i] = (flags & RE_MATCH) || (i == 0 && (flags & RE_MATCH_AT_END));
+		any |= starts[i];
+	}
+	if (!any) return 0;
+
+	// longest matches can make a forward run read far past the end of its
+	// match, over and over on one row. past this budget runs stop at the
+	// first match they find, which keeps the row linear
+	long budget = 4L * len + 256;
+	int n = 0;
+	int from = 0;
+	for (i = 0; i < len; i++) {
+		if (!starts[i] || i < from) continue;
+		int end = -1;
+		int k;
+		state = reStart(&mt->fwd, i == 0);
+		for (k = i; k < len; k++) {
+			state = reStep(&mt->fwd, state, (unsigned char)s[k]);
+			int flags = mt->fwd.flags[state];
+			if (flags & RE_DEAD) break;
+			if (flags & RE_MATCH) {
+				end = k + 1;
+				if (budget <= 0) break;
+			}
+		}
+		budget -= k - i;
+		if (k == len && (mt->fwd.flags[state] & RE_MATCH_AT_END)) end = len;
+		if (end <= i) continue;
+		if (n == *cap) {
+			*cap = *cap ? *cap * 2 : 16;
+			*hits = realloc(*hits, sizeof(struct textSpan) * *cap);
+		}
+		(*hits)[n].start = i;
+		(*hits)[n].len = end - i;
+		n++;
+		from = end;
+	}
+	return n;
+}
+
+/*** find ***/
+
+#define KILO_SEARCH_MAX_MATCHES (1 << 20) // stop caching matches past this
+#define KILO_SEARCH_MAX_THREADS 8
+#define KILO_SEARCH_THREAD_ROWS 8192 // buffers smaller than this scan inline
+#define KILO_REGEX_CACHE 8 // compiled regexes kept around
+
+const char *editorSearchMem(const char *hay, int len, const char *needle, int nlen) {
+	// substring search over len bytes of hay, which doesn't need to be nul
+	// terminated. with SSE2 we test 16 starting positions at once by checking
+	// the first and last byte of the needle, and only memcmp the candidates
+	if (nlen == 0 || nlen > len) return NULL;
+	if (nlen == 1) return memchr(hay, needle[0], len);
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+	for (; i + nlen - 1 + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&hay[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&hay[i + nlen - 1]);
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+																												_mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (!memcmp(&hay[i + bit + 1], needle + 1, nlen - 2)) return &hay[i + bit];
+			mask &= mask - 1;
+		}
+	}
+#endif
+	// the tail (or everything without SSE2): let memchr find the first byte
+	const char *p = hay + i;
+	const char *end = hay + len - nlen + 1;
+	while (p < end && (p = memchr(p, needle[0], end - p)) != NULL) {
+		if (!memcmp(p, needle, nlen)) return p;
+		p++;
+	}
+	return NULL;
+}
+
+struct searchMatch {
+	int row;
+	int cx; // matches are in chars, so tabs in the row don't get in the way
+};
+
+// finds the matches in a row, for plain text or a regex. each thread that
+// scans rows has its own, a regex matcher's DFA caches are not shared
+struct searchMatcher {
+	const char *query; // plain text
+	int qlen;
+	struct regexMatcher *rm; // regex, NULL for plain text
+	struct textSpan *hits;
+	int cap;
+};
+
+static int searchRow(struct searchMatcher *mt, const char *s, int len) {
+	// every match in s into mt->hits. plain text matches may overlap, that
+	// way the matches of a longer query are always a subset
+	if (mt->rm) return regexScan(mt->rm, s, len, &mt->hits, &mt->cap);
+	int n = 0;
+	const char *p = s;
+	const char *end = s + len;
+	while ((p = editorSearchMem(p, end - p, mt->query, mt->qlen)) != NULL) {
+		if (n == mt->cap) {
+			mt->cap = mt->cap ? mt->cap * 2 : 16;
+			mt->hits = realloc(mt->hits, sizeof(struct textSpan) * mt->cap);
+		}
+		mt->hits[n].start = p - s;
+		mt->hits[n].len = mt->qlen;
+		n++;
+		p++;
+	}
+	return n;
+}
+
+/* a scan of the whole buffer is split into parts that run on worker threads,
+ * all reading the same snapshot of the text. a job that gets replaced by a
+ * newer query is cancelled and forgotten, whoever lets go of it last frees
+ * it, so the UI thread never waits on a scan */
+struct searchJob;
+
+struct searchPart {
+	struct searchJob *job;
+	int start, end; // rows [start, end) of the buffer
+	struct searchMatch *m;
+	int n, cap;
+	int count; // matches seen, keeps counting once m is full
+	int truncated;
+	int finished; // set by the worker when m and count are ready
+};
+
+struct searchJob {
+	char *query;
+	int qlen;
+	struct regex *re; // NULL for a plain text search
+	struct textSnapshot *snap; // what the parts scan
+	int nparts;
+	struct searchPart *parts;
+	int merged; // parts already copied into the cache
+	int cancel; // set by the UI thread, checked by the workers
+	int refs; // one per running worker, plus one for the UI thread
+};
+
+// every match of the current query in file order. the buffer can't change
+// while the search prompt is up, so row numbers stay valid until it closes
+struct searchCache {
+	char *query;
+	int qlen;
+	struct searchMatch *m;
+	int n;
+	int cap;
+	int truncated; // gave up at KILO_SEARCH_MAX_MATCHES, m isn't complete
+	int total; // matches in the whole buffer, counting the ones not in m
+	int current; // index into m of the match we're on, -1 if not in m
+	int found; // at is a match we jumped to
+	struct searchMatch at;
+	struct searchJob *job; // scan still running for query
+	struct searchMatcher mt; // for the UI thread
+	int regex; // query is a regex, stays on between searches
+	const char *error; // why the regex didn't compile
+};
+
+struct searchCache SC;
+
+int search_workers = 0; // worker threads that haven't exited yet
+
+// the last few regexes typed, so deleting a character back to an earlier
+// pattern (or moving between matches) reuses its automaton
+struct regexMatcher *regex_cache[KILO_REGEX_CACHE];
+char *regex_cache_pattern[KILO_REGEX_CACHE];
+
+static struct regexMatcher *searchRegex(const char *pattern, const char **error) {
+	int i;
+	for (i = 0; i < KILO_REGEX_CACHE && regex_cache[i]; i++) {
+		if (!strcmp(regex_cache_pattern[i], pattern)) break;
+	}
+	if (i == KILO_REGEX_CACHE || !regex_cache[i]) {
+		struct regex *re = regexCompile(pattern, strlen(pattern), error);
+		if (!re) return NULL;
+		// the least recently used one makes room
+		if (i == KILO_REGEX_CACHE) {
+			i--;
+			regexMatcherFree(regex_cache[i]);
+			free(regex_cache_pattern[i]);
+		}
+		regex_cache[i] = regexMatcherNew(re);
+		regex_cache_pattern[i] = strdup(pattern);
+		regexRelease(re);
+	}
+	// move it to the front
+	struct regexMatcher *rm = regex_cache[i];
+	char *p = regex_cache_pattern[i];
+	memmove(&regex_cache[1], &regex_cache[0], sizeof(regex_cache[0]) * i);
+	memmove(&regex_cache_pattern[1], &regex_cache_pattern[0], sizeof(char *) * i);
+	regex_cache[0] = rm;
+	regex_cache_pattern[0] = p;
+	return rm;
+}
+
+static void searchJobRelease(struct searchJob *job) {
+	if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+	int i;
+	for (i = 0; i < job->nparts; i++) free(job->parts[i].m);
+	free(job->parts);
+	free(job->query);
+	regexRelease(job->re);
+	editorSnapRelease(job->snap);
+	free(job);
+}
+
+static void searchCancel(void) {
+	if (!SC.job) return;
+	__atomic_store_n(&SC.job->cancel, 1, __ATOMIC_RELAXED);
+	searchJobRelease(SC.job);
+	SC.job = NULL;
+}
+
+static void searchReset(void) {
+	searchCancel();
+	free(SC.query);
+	free(SC.m);
+	free(SC.mt.hits);
+	int regex = SC.regex;
+	memset(&SC, 0, sizeof(SC));
+	SC.current = -1;
+	SC.regex = regex;
+}
+
+static void searchScanPart(struct searchPart *part, struct regexMatcher *rm) {
+	// collect every match in the part's rows, using rm if the search is a
+	// regex and the caller has a matcher to lend
+	struct searchJob *job = part->job;
+	struct searchMatcher mt = {job->query, job->qlen, rm, NULL, 0};
+	if (job->re && !rm) mt.rm = regexMatcherNew(job->re);
+	int limit = KILO_SEARCH_MAX_MATCHES / job->nparts;
+	int filerow = part->start;
+	const struct snapRow *row = NULL;
+	struct snapReader rd = {0};
+	int left = 0;
+	for (; filerow < part->end; row++, left--, filerow++) {
+		if (left == 0 && (row = editorSnapRows(job->snap, filerow, &left, &rd)) == NULL)
+			break;
+		if ((filerow & 255) == 0 && __atomic_load_n(&job->cancel, __ATOMIC_RELAXED))
+			break;
+		int n = searchRow(&mt, row->chars, row->size);
+		int i;
+		for (i = 0; i < n; i++) {
+			part->count++;
+			if (part->n == limit) {
+				part->truncated = 1;
+				continue;
+			}
+			if (part->n == part->cap) {
+				part->cap = part->cap ? part->cap * 2 : 64;
+				part->m = realloc(part->m, sizeof(struct searchMatch) * part->cap);
+			}
+			part->m[part->n].row = filerow;
+			part->m[part->n].cx = mt.hits[i].start;
+			part->n++;
+		}
+	}
+	if (mt.rm != rm) regexMatcherFree(mt.rm);
+	free(mt.hits);
+	editorSnapReaderFree(&rd);
+	__atomic_store_n(&part->finished, 1, __ATOMIC_RELEASE);
+}
+
+static void *searchWorker(void *arg) {
+	struct searchPart *part = arg;
+	searchScanPart(part, NULL);
+	searchJobRelease(part->job);
+	__atomic_sub_fetch(&search_workers, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int searchThreads(void) {
+	// one part per core, but small buffers aren't worth starting threads for
+	if (E.numrows < KILO_SEARCH_THREAD_ROWS) return 1;
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > KILO_SEARCH_MAX_THREADS) n = KILO_SEARCH_MAX_THREADS;
+	if (n > E.numrows / (KILO_SEARCH_THREAD_ROWS / 4)) n = E.numrows / (KILO_SEARCH_THREAD_ROWS / 4);
+	return n;
+}
+
+static void searchStart(const char *query, int qlen) {
+	// throw away the old matches and start scanning for query
+	searchCancel();
+	SC.n = 0;
+	SC.total = 0;
+	SC.truncated = 0;
+
+	struct searchJob *job = calloc(1, sizeof(struct searchJob));
+	job->query = malloc(qlen);
+	memcpy(job->query, query, qlen);
+	job->qlen = qlen;
+	if (SC.mt.rm) {
+		job->re = SC.mt.rm->re;
+		__atomic_add_fetch(&job->re->refs, 1, __ATOMIC_RELAXED);
+	}
+	job->snap = editorSnapshot();
+	job->nparts = searchThreads();
+	job->parts = calloc(job->nparts, sizeof(struct searchPart));
+	job->refs = 1;
+	SC.job = job;
+	int i;
+	for (i = 0; i < job->nparts; i++) {
+		struct searchPart *part = &job->parts[i];
+		part->job = job;
+		part->start = (long long)job->snap->numrows * i / job->nparts;
+		part->end = (long long)job->snap->numrows * (i + 1) / job->nparts;
+	}
+	if (job->nparts == 1) {
+		searchScanPart(&job->parts[0], SC.mt.rm);
+		return;
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < job->nparts; i++) {
+		pthread_t tid;
+		__atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&search_workers, 1, __ATOMIC_RELAXED);
+		if (pthread_create(&tid, &attr, searchWorker, &job->parts[i]) != 0) {
+			// no thread to be had, do this part ourselves
+			__atomic_sub_fetch(&search_workers, 1, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+			searchScanPart(&job->parts[i], SC.mt.rm);
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+static void searchAdd(struct searchMatch *m, int n) {
+	if (SC.n + n > SC.cap) {
+		if (!SC.cap) SC.cap = 64;
+		while (SC.cap < SC.n + n) SC.cap *= 2;
+		SC.m = realloc(SC.m, sizeof(struct searchMatch) * SC.cap);
+	}
+	memcpy(&SC.m[SC.n], m, sizeof(struct searchMatch) * n);
+	SC.n += n;
+}
+
+static int searchMerge(void) {
+	// copy the parts that are done into the cache, in order so the matches
+	// stay sorted. returns 1 if anything new came in
+	struct searchJob *job = SC.job;
+	if (!job) return 0;
+	int old = SC.n;
+	int truncated = SC.truncated;
+	while (job->merged < job->nparts) {
+		struct searchPart *part = &job->parts[job->merged];
+		if (!__atomic_load_n(&part->finished, __ATOMIC_ACQUIRE)) break;
+		// once a part ran out of room the cache stops at it, anything after
+		// would leave a hole in the middle of the matches
+		if (!SC.truncated) searchAdd(part->m, part->n);
+		if (part->truncated) SC.truncated = 1;
+		SC.total += part->count;
+		job->merged++;
 	}
+	if (job->merged == job->nparts) {
+		searchJobRelease(job);
+		SC.job = NULL;
+	}
+	return SC.n != old || SC.truncated != truncated || !SC.job;
 }
 
+static void searchRefine(const char *query, int qlen) {
+	// the query grew at the end, so every new match starts where an old one
+	// did. keep the old matches that still match and drop the rest
+	int kept = 0;
+	int i;
+	erow *row = NULL;
+	int filerow = -1;
+	for (i = 0; i < SC.n; i++) {
+		if (SC.m[i].row != filerow) {
+			filerow = SC.m[i].row;
+			row = editorRowAt(filerow);
+		}
+		if (SC.m[i].cx + qlen <= row->size &&
+				!memcmp(&row->chars[SC.m[i].cx], query, qlen))
+			SC.m[kept++] = SC.m[i];
+	}
+	SC.n = kept;
+	SC.total = kept;
+}
 
-/*** file i/o ***/
+static void searchUpdate(char *query) {
+	// bring the match cache in line with the query typed so far
+	int qlen = strlen(query);
+	if (SC.query && qlen == SC.qlen && !strcmp(SC.query, query)) return;
+	SC.error = NULL;
+	SC.mt.rm = SC.regex ? searchRegex(query, &SC.error) : NULL;
+	if (SC.error) {
+		// nothing can match a pattern that doesn't compile
+		searchCancel();
+		SC.n = SC.total = SC.truncated = 0;
+	} else if (SC.query && !SC.regex && !SC.job && !SC.truncated &&
+						 qlen > SC.qlen && !strncmp(SC.query, query, SC.qlen)) {
+		searchRefine(query, qlen);
+	} else {
+		searchStart(query, qlen);
+		searchMerge();
+	}
+	free(SC.query);
+	SC.query = strdup(query);
+	SC.qlen = qlen;
+	SC.mt.query = SC.query;
+	SC.mt.qlen = qlen;
+	SC.current = -1;
+	SC.found = 0;
+}
 
-char *editorRowsToString(int *buflen) {
-	int totlen = 0;
-	int j;
-	for (j = 0; j < E.numrows; j++) {
-		totlen += E.row[j].size + 1;
+static int searchIndex(struct searchMatch at) {
+	// where a match sits in the cache, or -1 if the cache doesn't have it
+	int lo = 0, hi = SC.n;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		struct searchMatch *m = &SC.m[mid];
+		if (m->row < at.row || (m->row == at.row && m->cx < at.cx)) lo = mid + 1;
+		else hi = mid;
 	}
-	*buflen = totlen;
+	if (lo < SC.n && SC.m[lo].row == at.row && SC.m[lo].cx == at.cx) return lo;
+	return -1;
+}
 
-	char *buf = malloc(totlen);
-	char *p = buf;
-	for (j = 0; j < E.numrows; j++) {
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*p = '\n';
-		p++;
+static int searchStep(int from_row, int from_cx, int direction, struct searchMatch *out) {
+	// the cache can't answer, look for the next match the slow way, a row at
+	// a time starting from a position. returns 1 and fills out if found
+	int filerow = from_row;
+	erow *row = editorRowAt(filerow);
+	int i;
+	for (i = 0; i <= E.numrows; i++) {
+		int n = searchRow(&SC.mt, row->chars, row->size);
+		int j, hit = -1;
+		for (j = 0; j < n; j++) {
+			int cx = SC.mt.hits[j].start;
+			if (direction == 1 && (i > 0 || cx > from_cx)) { hit = cx; break; }
+			if (direction == -1 && (i > 0 || cx < from_cx)) hit = cx;
+		}
+		if (hit != -1) {
+			out->row = filerow;
+			out->cx = hit;
+			return 1;
+		}
+		filerow += direction;
+		if (filerow == -1) filerow = E.numrows - 1;
+		else if (filerow == E.numrows) filerow = 0;
+		row = editorRowAt(filerow);
 	}
-	return buf;
+	return 0;
 }
 
+static void searchJump(struct searchMatch at) {
+	SC.at = at;
+	SC.found = 1;
+	E.cy = at.row;
+	E.cx = at.cx;
+	E.rowoff = E.numrows; // editorScroll brings the match to the top
+}
 
-void editorOpen(char *filename) {
-	free(E.filename);
-	E.filename = strdup(filename);
+int editorSearchPending(void) {
+	return SC.job != NULL;
+}
 
-	editorSelectSyntaxHighlight();
-	
-	FILE *fp = fopen(filename, "r");
-	if (!fp) die("fopen");
-	
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' ||
-													 line[linelen - 1] == '\r'))
-			linelen--;
-		editorInsertRow(E.numrows, line, linelen);
-	}
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
+int editorSearchBusy(void) {
+	// a cancelled job's workers can still be reading rows for a little bit
+	return __atomic_load_n(&search_workers, __ATOMIC_ACQUIRE) > 0;
 }
 
-void editorSave(void) {
-	if (E.filename == NULL) {
-		E.filename = editorPrompt("Save as %s (ESC to cancel)", NULL);
-		if (E.filename == NULL) {
-			editorSetStatusMessage("Save aborted");
-			return;
-		}
-		editorSelectSyntaxHighlight();
+int editorSearchPoll(void) {
+	// pick up whatever the workers finished. returns 1 if the screen needs
+	// to be redrawn
+	if (!searchMerge()) return 0;
+	if (!SC.found && SC.n > 0) {
+		SC.current = 0;
+		searchJump(SC.m[0]);
 	}
+	return 1;
+}
 
-	int len;
-	char *buf = editorRowsToString(&len);
-
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len) == len) {
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
-			}
-		}
-		close(fd);
+int editorSearchMatchesAt(erow *row, unsigned char *hl) {
+	// mark every match of the search in a row's rendered highlight. returns 0
+	// if there's no search going
+	if (!SC.query || SC.qlen == 0 || SC.error) return 0;
+	int n = searchRow(&SC.mt, row->chars, row->size);
+	int rsize = editorRowDisplay(row)->rsize;
+	int i;
+	for (i = 0; i < n; i++) {
+		struct textSpan *hit = &SC.mt.hits[i];
+		int rx = editorRowCxToRx(row, hit->start);
+		int len = editorRowCxToRx(row, hit->start + hit->len) - rx;
+		if (rx + len > rsize) len = rsize - rx;
+		memset(&hl[rx], HL_MATCH, len);
 	}
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	return 1;
 }
 
-/*** find ***/
+int editorSearchStatus(char *buf, int size) {
+	// match count for the message bar, like " [3/120]"
+	char *mode = SC.regex ? "regex " : "";
+	if (SC.error) {
+		return snprintf(buf, size, " [regex: %s]", SC.error);
+	} else if (!SC.query || SC.qlen == 0) {
+		return SC.regex ? snprintf(buf, size, " [regex]") : 0;
+	} else if (SC.job) {
+		return snprintf(buf, size, " [%ssearching, %d so far]", mode, SC.total);
+	} else if (SC.total == 0) {
+		return snprintf(buf, size, " [%sno matches]", mode);
+	} else if (SC.current >= 0) {
+		return snprintf(buf, size, " [%s%d/%d]", mode, SC.current + 1, SC.total);
+	} else {
+		return snprintf(buf, size, " [%s%d matches]", mode, SC.total);
+	}
+}
 
 /* callback function to find match for query */
 void editorFindCallback(char *query, int key) {
-	
-	static int last_match = -1;
-	static int direction = 1;
-
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
-
-	if (saved_hl) {
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
+	if (key == '\r' || key == '\n' || key == '\x1b') {
+		searchReset();
+		return;
 	}
-	
-	if (key == '\r' || key == '\n') {
-		last_match = -1;
-		direction = 1;
+	if (key == CTRL_KEY('r')) {
+		// switch between plain text and regex, the query gets searched again
+		SC.regex = !SC.regex;
+		free(SC.query);
+		SC.query = NULL;
+	}
+	if (query[0] == '\0') {
+		searchReset();
 		return;
-	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+	}
+
+	int direction = 0;
+	if (key == ARROW_RIGHT || key == ARROW_DOWN) {
 		direction = 1;
 	} else if (key == ARROW_LEFT || key == ARROW_UP) {
 		direction = -1;
 	} else {
-		last_match = -1;
-		direction = 1;
+		searchUpdate(query);
 	}
 
-
-	if (last_match == -1) direction = 1;
-	int current = last_match;
-	int i;
-	for (i = 0; i < E.numrows; i++) {
-		current += direction;
-		if (current == -1) current = E.numrows - 1;
-		else if (current == E.numrows) current = 0;
-
-		
-		erow *row = &E.row[current];
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			E.cy = current;
-			E.cx = editorRowRxToCx(row, match - row->render);
-			E.rowoff = E.numrows;
-
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
-		}
+	struct searchMatch at;
+	if (direction == 0) {
+		// a new query: go to its first match, or wait for the scan to find one
+		if (SC.n == 0) return;
+		SC.current = 0;
+		at = SC.m[0];
+	} else if (!SC.job && !SC.truncated) {
+		// all the matches are cached, moving between them is just an index
+		if (SC.n == 0) return;
+		SC.current = (SC.current + direction + SC.n) % SC.n;
+		at = SC.m[SC.current];
+	} else {
+		// the cache isn't complete, step from where we are
+		struct searchMatch from = SC.found ? SC.at : (struct searchMatch){E.cy, E.cx};
+		if (E.numrows == 0 || !searchStep(from.row, from.cx, direction, &at)) return;
+		SC.current = searchIndex(at);
 	}
+	searchJump(at);
 }
 
 void editorFind(void) {
@@ -738,8 +5420,11 @@ void editorFind(void) {
 	int save_coloff = E.coloff;
 	int save_rowoff = E.rowoff;
 	
-	char *query = editorPrompt("Search: %s (ESC/Arrows/Enter)",
+	searchReset();
+	char *query = editorPrompt("Search: %s (ESC/Arrows/Enter/^R regex)",
 														 editorFindCallback);
+	// workers that are still going read their snapshot, the buffer can be
+	// edited again right away
 	if (query) {
 		free(query);
 	} else {
@@ -750,42 +5435,158 @@ void editorFind(void) {
 	}
 }
 
+/*** goto ***/
+
+void editorGoto(void) {
+	// jump to a line, or with an @ in front to a byte offset into the file.
+	// both are found going down the row tree by its line and byte totals
+	char *query = editorPrompt("Go to line or @offset: %s (ESC to cancel)", NULL);
+	if (query == NULL) return;
+	int offset = query[0] == '@';
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(query + offset, &end, 0);
+	if (!isdigit((unsigned char)query[offset]) || *end != '\0' || errno) {
+		editorSetStatusMessage("Not a %s: %s", offset ? "byte offset" : "line number", query);
+		free(query);
+		return;
+	}
+	free(query);
+	if (offset) {
+		E.cy = editorOffsetRow(n < SIZE_MAX ? n : SIZE_MAX, &E.cx);
+	} else {
+		int line = n > 0 && n <= INT_MAX ? n - 1 : n > 0 ? INT_MAX : 0;
+		E.cy = editorLineRow(line);
+		if (E.cy == E.numrows && E.cy > 0) E.cy--; // past the end, go to the last line
+		E.cx = 0;
+	}
+	// put it in the middle of the screen, unless it's already on it
+	if (E.cy < E.rowoff || E.cy >= E.rowoff + E.screenrows) {
+		E.rowoff = E.cy > E.screenrows / 2 ? E.cy - E.screenrows / 2 : 0;
+		E.wrap.top = 0;
+	}
+}
+
+void editorLineNumbersToggle(void) {
+	E.linenumbers = !E.linenumbers;
+	editorSetStatusMessage(E.linenumbers ? "Line numbers on" : "Line numbers off");
+}
+
 /*** append buffer ***/
 
 struct abuf {
 	char *b;
-	int len;
+	size_t len;
+	size_t cap; // bytes allocated for b, grows by doubling
 };
 
-#define ABUF_INIT {NULL, 0}
-
-void abAppend(struct abuf *ab, const char *s, int len) {
-	char *new = realloc(ab->b, ab->len + len);
-	// realloc abuf buffer, to a new block of memory with an increased size
-
-	if (new == NULL) return;
-	// if new is unable to allocate memory, it returns NULL
-	memcpy(&new[ab->len], s, len);
-	// copy s into the new block of memory starting at the end of the original string
-	ab->b = new;
-	// point b to the new block of memory
+#define ABUF_INIT {NULL, 0, 0}
+
+void abAppend(struct abuf *ab, const char *s, size_t len) {
+	if (len == 0) return; // an empty buffer's b is still NULL, memcpy can't have it
+	if (len > ab->cap - ab->len) {
+		// out of room, double the capacity until it fits so a buffer that is
+		// reused frame after frame stops reallocating once it's big enough
+		if (len > SIZE_MAX / 2 - ab->len) return; // can't ever fit
+		size_t cap = ab->cap ? ab->cap : 64;
+		while (cap < ab->len + len) cap *= 2;
+		char *new = realloc(ab->b, cap);
+		PROF_ALLOC();
+		if (new == NULL) return;
+		// if new is unable to allocate memory, it returns NULL
+		ab->b = new;
+		ab->cap = cap;
+	}
+	memcpy(&ab->b[ab->len], s, len);
+	// copy s into the buffer starting at the end of the original string
 	ab->len += len;
 	// add the length of the newly added string
 }
 
+void abAppendNum(struct abuf *ab, int n) {
+	// append a non-negative number in decimal, for escape sequences
+	char buf[12];
+	int i = sizeof(buf);
+	do {
+		buf[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	abAppend(ab, &buf[i], sizeof(buf) - i);
+}
+
+void abAppendCursor(struct abuf *ab, int row, int col) {
+	// "\x1b[<row>;<col>H", coordinates start at 1
+	abAppend(ab, "\x1b[", 2);
+	abAppendNum(ab, row);
+	abAppend(ab, ";", 1);
+	abAppendNum(ab, col);
+	abAppend(ab, "H", 1);
+}
+
 void abFree(struct abuf *ab) {
 	free(ab->b);
+	ab->b = NULL;
+	ab->len = 0;
+	ab->cap = 0;
 }
 
 /*** output ***/
 
+static int wrapScreenTop(void) {
+	return wrapLineAt(E.rowoff) + E.wrap.top;
+}
+
+static void wrapScroll(void) {
+	// the same as below but in visual lines. only the rows between the top
+	// of the screen and the cursor get counted, however far apart the two
+	// are the lines in front of them cancel out
+	int cols = E.screencols - E.gutter;
+	if (E.wrap.cols != cols) wrapReset(); // resized
+	E.coloff = 0;
+	int sub = E.rx / cols;
+
+	if (E.rowoff < E.numrows) {
+		// the top row may have got shorter
+		wrapRows(E.rowoff, E.rowoff);
+		int wraps = editorRowAt(E.rowoff)->wraps;
+		if (E.wrap.top >= wraps) E.wrap.top = wraps - 1;
+	}
+	if (E.cy < E.rowoff || (E.cy == E.rowoff && sub < E.wrap.top)) {
+		E.rowoff = E.cy;
+		E.wrap.top = sub;
+	}
+	int far = E.cy - E.rowoff >= E.screenrows; // every row takes a line at least
+	wrapRows(far ? E.cy - E.screenrows : E.rowoff, E.cy);
+	int line = wrapLineAt(E.cy) + sub;
+	if (far || line - wrapScreenTop() >= E.screenrows)
+		E.rowoff = wrapRowAt(line - E.screenrows + 1, &E.wrap.top);
+
+	E.sy = line - wrapScreenTop();
+	E.sx = E.gutter + E.rx - sub * cols;
+}
+
+static void gutterWidth(void) {
+	// a column for each digit of the last line number and one to keep them
+	// off the text, as long as that leaves most of the screen to the text
+	E.gutter = 0;
+	if (!E.linenumbers) return;
+	int width = 2;
+	for (int n = editorLineCount(); n >= 10; n /= 10) width++;
+	if (width <= E.screencols / 2) E.gutter = width;
+}
+
 void editorScroll(void) {
 	E.rx = 0;
+	gutterWidth();
 
 	if (E.cy < E.numrows) {
-		E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+		E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
 	}
 
+	if (E.wrap.on) {
+		wrapScroll();
+		return;
+	}
 	if (E.cy < E.rowoff) {
 		E.rowoff = E.cy; // keep rowoffset always below cursor y
 	}
@@ -795,16 +5596,185 @@ void editorScroll(void) {
 	if (E.rx < E.coloff) { // clamp coloffset
 		E.coloff = E.rx;
 	}
-	if (E.rx >= E.coloff + E.screencols) {
-		E.coloff = E.rx - E.screencols + 1;
+	int cols = E.screencols - E.gutter;
+	if (E.rx >= E.coloff + cols) {
+		E.coloff = E.rx - cols + 1;
+	}
+	E.sy = E.cy - E.rowoff;
+	E.sx = E.gutter + E.rx - E.coloff;
+}
+
+/* the screen is drawn into a back buffer of one abuf per terminal line,
+ * then compared against the front buffer (what the terminal shows right
+ * now) so only the lines, or the tails of lines, that changed get sent */
+struct screenBuffer {
+	struct abuf *front;
+	struct abuf *back;
+	int lines; // screenrows plus the status and message bars
+	int cols;
+	int rowoff, coloff; // offsets the front buffer was drawn at
+	int top; // and the visual line at the top of it in soft wrap mode
+	int valid; // 0 when we don't know what's on the terminal
+	struct abuf *sink; // frames go here instead of the terminal if set, for bench.c
+};
+
+struct screenBuffer S;
+
+void editorScreenInvalidate(void) {
+	S.valid = 0;
+}
+
+static void screenResize(void) {
+	int lines = E.screenrows + 2;
+	if (lines == S.lines && E.screencols == S.cols) return;
+	for (int y = 0; y < S.lines; y++) {
+		abFree(&S.front[y]);
+		abFree(&S.back[y]);
+	}
+	S.front = realloc(S.front, sizeof(struct abuf) * lines);
+	S.back = realloc(S.back, sizeof(struct abuf) * lines);
+	for (int y = 0; y < lines; y++) {
+		S.front[y] = (struct abuf)ABUF_INIT;
+		S.back[y] = (struct abuf)ABUF_INIT;
+	}
+	S.lines = lines;
+	S.cols = E.screencols;
+	S.valid = 0;
+}
+
+static struct abuf *screenLine(int y) {
+	// hand out back buffer line y, emptied but keeping its memory
+	S.back[y].len = 0;
+	return &S.back[y];
+}
+
+static size_t screenCommonPrefix(struct abuf *old, struct abuf *new,
+																 int *col, int *inverse, int *fg) {
+	// find how much of a line the terminal already shows correctly. returns
+	// the byte offset into new to resume drawing from, and the column and
+	// colours that are in effect at that point
+	size_t i = 0, safe = 0;
+	int c = 0, inv = 0, f = 39;
+	*col = 0; *inverse = 0; *fg = 39;
+	while (i < old->len && i < new->len && old->b[i] == new->b[i]) {
+		if (new->b[i] == '\x1b') {
+			// only skip whole escape sequences that match in both lines
+			size_t j = i + 1;
+			while (j < new->len && !isalpha((unsigned char)new->b[j])) j++;
+			if (j >= new->len || j >= old->len ||
+					memcmp(&old->b[i], &new->b[i], j - i + 1)) break;
+			if (new->b[j] == 'm') {
+				int p = atoi(&new->b[i + 2]);
+				if (p == 0) { inv = 0; f = 39; }
+				else if (p == 7) inv = 1;
+				else f = p;
+			}
+			i = j + 1;
+		} else {
+			// always redraw the last column, and give up on anything that
+			// isn't plain ascii since we can't tell how wide it is
+			if (c == E.screencols - 1 || (unsigned char)new->b[i] >= 0x80) break;
+			c++;
+			i++;
+		}
+		safe = i;
+		*col = c; *inverse = inv; *fg = f;
+	}
+	return safe;
+}
+
+static void screenEmitLine(struct abuf *ab, int y) {
+	struct abuf *old = &S.front[y];
+	struct abuf *new = &S.back[y];
+	// lines that were never drawn into have no buffer, memcmp can't be given
+	// that even for 0 bytes
+	if (S.valid && old->len == new->len &&
+			(new->len == 0 || !memcmp(old->b, new->b, new->len)))
+		return;
+
+	int col = 0, inverse = 0, fg = 39;
+	size_t from = 0;
+	if (S.valid) from = screenCommonPrefix(old, new, &col, &inverse, &fg);
+
+	abAppendCursor(ab, y + 1, col + 1);
+	if (inverse) abAppend(ab, "\x1b[7m", 4);
+	if (fg != 39) abAppend(ab, colorEscapes[fg - 30], COLOR_ESCAPE_LEN);
+	abAppend(ab, &new->b[from], new->len - from);
+	abAppend(ab, "\x1b[K", 3);
+}
+
+static void screenScroll(struct abuf *ab) {
+	// when the file scrolled by a few lines, have the terminal move the text
+	// that is still on screen instead of drawing it all again
+	int d = E.wrap.on ? wrapScreenTop() - S.top : E.rowoff - S.rowoff;
+	if (!S.valid || d == 0 || E.coloff != S.coloff) return;
+	if (d >= E.screenrows - 1 || -d >= E.screenrows - 1) return;
+
+	int n = d > 0 ? d : -d;
+	abAppend(ab, "\x1b[1;", 4);
+	abAppendNum(ab, E.screenrows);
+	abAppend(ab, "r\x1b[", 3);
+	abAppendNum(ab, n);
+	abAppend(ab, d > 0 ? "S\x1b[r" : "T\x1b[r", 4);
+
+	// move the front lines the same way, the lines scrolled in are blank
+	struct abuf tmp[n];
+	int y;
+	if (d > 0) {
+		memcpy(tmp, S.front, sizeof(struct abuf) * n);
+		memmove(S.front, &S.front[n], sizeof(struct abuf) * (E.screenrows - n));
+		memcpy(&S.front[E.screenrows - n], tmp, sizeof(struct abuf) * n);
+		for (y = E.screenrows - n; y < E.screenrows; y++) S.front[y].len = 0;
+	} else {
+		memcpy(tmp, &S.front[E.screenrows - n], sizeof(struct abuf) * n);
+		memmove(&S.front[n], S.front, sizeof(struct abuf) * (E.screenrows - n));
+		memcpy(S.front, tmp, sizeof(struct abuf) * n);
+		for (y = 0; y < n; y++) S.front[y].len = 0;
+	}
+}
+
+static void gutterNext(char *num, int *len) {
+	// add one to a line number kept as text, so it's only formatted once a frame
+	int i = *len - 1;
+	while (i >= 0 && num[i] == '9') num[i--] = '0';
+	if (i >= 0) {
+		num[i]++;
+		return;
 	}
+	memmove(num + 1, num, *len);
+	num[0] = '1';
+	(*len)++;
 }
 
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows(void) {
+	static const char blank[] = "                "; // wider than any gutter
 	int y;
+	int cols = E.screencols - E.gutter; // what's left for the text
+	erow *row = editorRowAt(E.rowoff);
+	int filerow = E.rowoff;
+	int sub = E.wrap.on ? E.wrap.top : 0; // visual line of a wrapped row that's next
+	erender *r = NULL; // row is set up for drawing
+	unsigned char *rowhl = NULL;
+	char num[16]; // line number of row, if it's the first row of its line
+	int numlen = 0;
+	int first = 0;
+	if (E.gutter && row) {
+		erow *prev = editorRowPrev(row);
+		first = !(prev && (prev->flags & ROW_JOINED));
+		numlen = snprintf(num, sizeof(num), "%d", editorRowLine(row) + 1);
+	}
 	for (y = 0; y < E.screenrows; y++) {
-		int filerow = y + E.rowoff;
-		if (y >= E.numrows) {
+		struct abuf *ab = screenLine(y);
+		if (row && E.gutter) {
+			if (first && sub == 0) {
+				abAppend(ab, blank, E.gutter - 1 - numlen);
+				abAppend(ab, num, numlen);
+				abAppend(ab, " ", 1);
+			} else {
+				abAppend(ab, blank, E.gutter);
+			}
+		}
+		if (row == NULL) {
 			if (E.numrows == 0 && y == E.screenrows / 3) {
 				char welcome[80];
 				int welcomelen = snprintf(welcome, sizeof(welcome),
@@ -820,57 +5790,97 @@ void editorDrawRows(struct abuf *ab) {
 			} else {
 				abAppend(ab, "~", 1);
 			}
-		} else {
-			int len = E.row[filerow].rsize - E.coloff;
+		} else if (r == NULL) {
+			if (row->flags & ROW_UNRENDERED) {
+				editorRowRender(row);
+			} else if (E.syntax && filerow >= E.hl_frontier) {
+				// the background pass hasn't got here yet, go with whatever
+				// state the row above has for now. right at the frontier that
+				// state is known good, so the frontier moves along with us
+				erow *prev = editorRowPrev(row);
+				int in_comment = editorRowOpenComment(prev);
+				if (filerow == E.hl_frontier) editorSyntaxStep(row, in_comment);
+				else editorLexRow(row, in_comment);
+			}
+			r = editorRowDisplay(row);
+			rowhl = r->hl;
+			if (r->rsize > 0) {
+				// matches of the search go on top of the syntax colours, in
+				// a copy so the row's own highlight stays as it was
+				static unsigned char *overlay = NULL;
+				static int overlay_cap = 0;
+				if (overlay_cap < r->rsize) {
+					overlay_cap = r->rsize * 2;
+					overlay = realloc(overlay, overlay_cap);
+				}
+				memcpy(overlay, r->hl, r->rsize);
+				if (editorSearchMatchesAt(row, overlay)) rowhl = overlay;
+			}
+		}
+		if (row) {
+			// in soft wrap mode each screen line shows the next piece of the row
+			int from = E.wrap.on ? sub * cols : E.coloff;
+			int len = r->rsize - from;
 			if (len < 0) len = 0;
-			if (len > E.screencols) len = E.screencols;
-			char *c = &E.row[filerow].render[E.coloff];
-			unsigned char *hl = &E.row[filerow].hl[E.coloff];
+			if (len > cols) len = cols;
+			char *c = &r->render[from];
+			unsigned char *hl = &rowhl[from];
 			int current_color = -1;
-			int j;
-			for (j = 0; j < len; j++) {
+			int j = 0;
+			while (j < len) {
 				if (iscntrl(c[j])) {
 					char sym = (c[j] <= 26 ) ? '@' + c[j] : '?';
 					abAppend(ab, "\x1b[7m", 4);
 					abAppend(ab, &sym, 1);
 					abAppend(ab, "\x1b[m", 3);
-					if (current_color != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-						abAppend(ab, buf, clen);
-					}
-			} else if (hl[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = -1;
-					}
-					abAppend(ab, &c[j], 1);
-				} else {
-					int color = editorSyntaxToColor(hl[j]);
-					if (color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abAppend(ab, buf, clen);
-					}
-					abAppend(ab, &c[j], 1);
+					if (current_color != -1)
+						abAppend(ab, colorEscapes[current_color - 30], COLOR_ESCAPE_LEN);
+					j++;
+					continue;
+				}
+				// copy the whole run of characters with the same highlight at once
+				int run = j + 1;
+				while (run < len && hl[run] == hl[j] && !iscntrl(c[run])) run++;
+				int color = (hl[j] == HL_NORMAL) ? -1 : editorSyntaxToColor(hl[j]);
+				if (color != current_color) {
+					current_color = color;
+					abAppend(ab, colorEscapes[(color == -1 ? 39 : color) - 30],
+									 COLOR_ESCAPE_LEN);
 				}
+				abAppend(ab, &c[j], run - j);
+				j = run;
 			}
 			abAppend(ab, "\x1b[39m", 5);
+			// counted the same way as wrapRowLines
+			if (E.wrap.on && ++sub <= r->rsize / cols) continue;
+			first = !(row->flags & ROW_JOINED);
+			if (first && E.gutter) gutterNext(num, &numlen);
+			row = editorRowNext(row);
+			filerow++;
+			sub = 0;
+			r = NULL;
 		}
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
 	}
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
+void editorDrawStatusBar(void) {
+	struct abuf *ab = screenLine(E.screenrows);
   abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-										 E.filename ? E.filename : "[No Name]", E.numrows,
-										 E.dirty ? "(modified)" : "");
+  char which[32] = "";
+  if (B.len > 1) snprintf(which, sizeof(which), "[%d/%d] ", B.cur + 1, B.len);
+  // file lines, the same as rows unless a line was too long for one
+  int lines = editorLineCount();
+  int line = E.cy < E.numrows ? editorRowLine(editorRowAt(E.cy)) + 1 : lines + 1;
+  int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s%s", which,
+										 E.filename ? E.filename : "[No Name]", lines,
+										 E.dirty ? "(modified) " : "",
+										 E.follow.on ? "(following)" : "");
   int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-											E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+											E.syntax ? E.syntax->filetype : "no ft", line, lines);
+#ifdef KILO_PROFILE
+  if (P.show) rlen = profStatus(rstatus, sizeof(rstatus));
+#endif
   if (len > E.screencols) len = E.screencols;
   abAppend(ab, status, len);
   while (len < E.screencols) {
@@ -883,25 +5893,37 @@ void editorDrawStatusBar(struct abuf *ab) {
     }
   }
   abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-	abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(void) {
+	struct abuf *ab = screenLine(E.screenrows + 1);
 	int msglen = strlen(E.statusmsg);
 	if (msglen > E.screencols) msglen = E.screencols;
-	if (msglen && time(NULL) - E.statusmsg_time < 5) {
+	if (msglen && time(NULL) - E.statusmsg_time < KILO_MESSAGE_SECS) {
 		abAppend(ab, E.statusmsg, msglen);
+		char count[48];
+		int countlen = editorSearchStatus(count, sizeof(count));
+		if (countlen > E.screencols - msglen) countlen = E.screencols - msglen;
+		if (countlen > 0) abAppend(ab, count, countlen);
 	}
 }
 
 void editorRefreshScreen(void) {
 	editorScroll();
-	
-	struct abuf ab = ABUF_INIT;
+	screenResize();
+
+	PROF_START(draw);
+	editorDrawRows();
+	PROF_END(PROF_DRAW, draw);
+	editorDrawStatusBar();
+	editorDrawMessageBar();
+
+	// the frame is built in one buffer that lives as long as the editor
+	static struct abuf ab = ABUF_INIT;
+	ab.len = 0;
 	
 	abAppend(&ab, "\x1b[?25l", 6); // hide cursor
-	abAppend(&ab, "\x1b[H", 3); // set cursor position to 1;1
+	size_t hidden = ab.len;
 	
 	// write(STDOUT_FILENO, "\x1b[2J", 4); // replaced with apAppend
 	// the 4 means we're writing four bytes to stdout
@@ -926,21 +5948,35 @@ void editorRefreshScreen(void) {
 	// would look something like this "\x1b[5;10H"
 	// row and col coords start at 1, not 0
 
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
+	screenScroll(&ab);
+	int y;
+	for (y = 0; y < S.lines; y++) screenEmitLine(&ab, y);
+	// nothing changed but the cursor, no need to hide it while it moves
+	int changed = ab.len > hidden;
+	if (!changed) ab.len = 0;
 
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
+	abAppendCursor(&ab, E.sy + 1, E.sx + 1);
 	
-	abAppend(&ab, "\x1b[?25h", 6); // show cursor
-
-	write(STDOUT_FILENO, ab.b, ab.len);
-	abFree(&ab);
+	if (changed) abAppend(&ab, "\x1b[?25h", 6); // show cursor
+
+	PROF_START(out);
+	if (S.sink) abAppend(S.sink, ab.b, ab.len);
+	else write(STDOUT_FILENO, ab.b, ab.len);
+	PROF_END(PROF_WRITE, out);
+	PROF_FRAME(ab.len);
+
+	// the terminal shows the back buffer now, swap so the next frame draws
+	// into the old front lines
+	struct abuf *tmp = S.front;
+	S.front = S.back;
+	S.back = tmp;
+	S.rowoff = E.rowoff;
+	S.coloff = E.coloff;
+	if (E.wrap.on) S.top = wrapScreenTop();
+	S.valid = 1;
 }
 
-void editorStatusMessage(const char *fmt, ...) {
+void editorSetStatusMessage(const char *fmt, ...) {
 	va_list ap;
 	va_start(ap, fmt);
 	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
@@ -948,6 +5984,246 @@ void editorStatusMessage(const char *fmt, ...) {
 	E.statusmsg_time = time(NULL);
 }
 
+/*** buffers ***/
+
+static void bufferCarry(struct editorConfig *to, struct editorConfig *from) {
+	// what belongs to the terminal rather than the file stays put on a switch
+	to->screenrows = from->screenrows;
+	to->screencols = from->screencols;
+	memcpy(to->statusmsg, from->statusmsg, sizeof(to->statusmsg));
+	to->statusmsg_time = from->statusmsg_time;
+	to->orig_termios = from->orig_termios;
+}
+
+static void bufferBlank(void) {
+	// turn E into an empty buffer with no file
+	struct editorConfig old = E;
+	memset(&E, 0, sizeof(E));
+	bufferCarry(&E, &old);
+	E.follow.fd = E.follow.ifd = -1;
+}
+
+static void chunkFreeTree(rowchunk *c) {
+	if (c == NULL) return;
+	chunkFreeTree(c->left);
+	chunkFreeTree(c->right);
+	for (int i = 0; i < c->count; i++) editorFreeRow(&c->rows[i]);
+	if (c->cold) snapRetire(c->cold, 0, c->coldcap);
+	chunkDropSnap(c);
+	free(c->render);
+	free(c);
+}
+
+static int bufferCanEvict(void) {
+	// nothing in E that isn't in the file, and nothing else reading it
+	editorSnapCollect();
+	return E.filename && !E.dirty && !E.follow.on && !E.snap.live &&
+		!E.journal.job && !E.journal.len;
+}
+
+static void bufferDrop(void) {
+	// free E's text and everything hanging off it, keeping the file name
+	// and the cursor for when it's loaded again
+	chunkFreeTree(E.rowtree);
+	E.rowtree = NULL;
+	E.numrows = 0;
+	if (E.map) munmap(E.map, E.maplen);
+	E.map = NULL;
+	E.maplen = 0;
+	free(E.undo.buf);
+	memset(&E.undo, 0, sizeof(E.undo));
+	free(E.snap.retired);
+	E.snap.retired = NULL;
+	E.snap.nretired = E.snap.retiredcap = 0;
+	free(E.journal.path);
+	free(E.journal.buf);
+	memset(&E.journal, 0, sizeof(E.journal));
+	E.hl_frontier = E.hl_resume = 0;
+	E.cold.next = 0;
+	rowArenaTrim();
+}
+
+static void bufferEvict(void) {
+	// least recently used first, until what's loaded fits under the cap
+	size_t loaded = editorBufferBytes();
+	for (int i = 0; i < B.len; i++)
+		if (i != B.cur && !B.bufs[i].evicted) loaded += chunkBytes(B.bufs[i].e.rowtree);
+	while (loaded > KILO_BUFFER_CAP) {
+		int victim = -1;
+		for (int i = 0; i < B.len; i++) {
+			struct editorBuffer *b = &B.bufs[i];
+			if (i == B.cur || b->evicted) continue;
+			if (victim == -1 || b->used < B.bufs[victim].used) {
+				struct editorConfig cur = E;
+				E = b->e;
+				int ok = bufferCanEvict();
+				b->e = E;
+				E = cur;
+				if (ok) victim = i;
+			}
+		}
+		if (victim == -1) return;
+		struct editorBuffer *b = &B.bufs[victim];
+		loaded -= chunkBytes(b->e.rowtree);
+		struct editorConfig cur = E;
+		E = b->e;
+		bufferDrop();
+		b->e = E;
+		E = cur;
+		b->evicted = 1;
+	}
+}
+
+static void bufferLoad(void) {
+	// read an evicted buffer back in and put the cursor where it was
+	struct editorConfig old = E;
+	int fd = open(old.filename, O_RDONLY);
+	if (fd == -1) {
+		editorSetStatusMessage("Can't reload %s: %s", old.filename, strerror(errno));
+		return;
+	}
+	close(fd);
+	char *filename = E.filename;
+	E.filename = NULL;
+	editorOpen(filename);
+	free(filename);
+	E.cy = old.cy < E.numrows ? old.cy : E.numrows;
+	E.cx = 0;
+	erow *row = editorRowAt(E.cy);
+	if (row) E.cx = old.cx < row->size ? old.cx : row->size;
+	E.rowoff = old.rowoff < E.numrows ? old.rowoff : 0;
+	if (E.wrap.on) wrapReset();
+}
+
+static void bufferSlots(void) {
+	// make room for one more, the first time E gets a slot of its own too
+	if (B.len + 2 > B.cap) {
+		B.cap = B.cap ? B.cap * 2 : 8;
+		B.bufs = realloc(B.bufs, sizeof(struct editorBuffer) * B.cap);
+	}
+	if (B.len == 0) B.bufs[B.len++] = (struct editorBuffer){.evicted = 0};
+	B.bufs[B.len] = (struct editorBuffer){.evicted = 0};
+}
+
+static void bufferPark(void) {
+	// put E back in its slot, the caller brings in what replaces it
+	E.journal.due = 0; // its edits go out now, they can't wait for it to come back
+	editorJournalPoll();
+	searchReset();
+	B.bufs[B.cur].e = E;
+	B.bufs[B.cur].used = ++B.tick;
+}
+
+static void bufferSwitch(int to) {
+	// park E and bring in another buffer, a struct copy either way
+	if (to == B.cur) return;
+	bufferPark();
+	E = B.bufs[to].e;
+	bufferCarry(&E, &B.bufs[B.cur].e);
+	B.cur = to;
+	if (B.bufs[to].evicted) {
+		B.bufs[to].evicted = 0;
+		bufferLoad();
+	}
+	editorScreenInvalidate();
+	bufferEvict();
+}
+
+void editorBufferOpen(char *filename) {
+	// open a file in a new buffer, or go to the buffer it's already open in
+	for (int i = 0; i < B.len; i++) {
+		char *name = i == B.cur ? E.filename : B.bufs[i].e.filename;
+		if (name && strcmp(name, filename) == 0) {
+			bufferSwitch(i);
+			return;
+		}
+	}
+	// editorOpen gives up on the whole program if it can't open the file,
+	// find out first
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+		return;
+	}
+	close(fd);
+	if (B.len == 0 && E.filename == NULL && E.numrows == 0) {
+		// nothing to park yet, the file goes in the empty buffer
+		editorOpen(filename);
+		return;
+	}
+	bufferSlots();
+	bufferPark();
+	B.cur = B.len++;
+	bufferBlank();
+	editorOpen(filename);
+	editorScreenInvalidate();
+	bufferEvict();
+}
+
+void editorBufferNext(void) {
+	if (B.len < 2) {
+		editorSetStatusMessage("No other buffers, Ctrl-O opens one");
+		return;
+	}
+	bufferSwitch((B.cur + 1) % B.len);
+	editorSetStatusMessage("%s (%d/%d)", E.filename ? E.filename : "[No Name]", B.cur + 1, B.len);
+}
+
+void editorBufferPrompt(void) {
+	char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL);
+	if (filename == NULL) return;
+	editorBufferOpen(filename);
+	free(filename);
+}
+
+int editorBuffersDirty(void) {
+	if (E.dirty) return 1;
+	for (int i = 0; i < B.len; i++)
+		if (i != B.cur && B.bufs[i].e.dirty) return 1;
+	return 0;
+}
+
+void editorBuffersDiscard(void) {
+	// quitting, none of the journals are wanted any more
+	for (int i = 0; i < B.len; i++) {
+		if (i == B.cur) continue;
+		struct editorConfig cur = E;
+		E = B.bufs[i].e;
+		editorJournalDiscard();
+		B.bufs[i].e = E;
+		E = cur;
+	}
+	editorJournalDiscard();
+}
+
+int editorBufferTimeout(void) {
+	// parked buffers still have their journal writes to look after
+	for (int i = 0; i < B.len; i++) {
+		struct journalState *j = &B.bufs[i].e.journal;
+		if (i != B.cur && (j->job || j->len)) return KILO_JOURNAL_POLL_MS;
+	}
+	return -1;
+}
+
+void editorBufferPoll(void) {
+	for (int i = 0; i < B.len; i++) {
+		struct editorBuffer *b = &B.bufs[i];
+		if (i == B.cur || (!b->e.journal.job && !b->e.journal.len && !b->e.snap.live))
+			continue;
+		struct editorConfig cur = E;
+		E = b->e;
+		editorSnapCollect();
+		editorJournalPoll();
+		b->e = E;
+		E = cur;
+		if (b->e.statusmsg_time != E.statusmsg_time) {
+			// a failed write should still be heard about
+			memcpy(E.statusmsg, b->e.statusmsg, sizeof(E.statusmsg));
+			E.statusmsg_time = b->e.statusmsg_time;
+		}
+	}
+}
+
 /*** input ***/
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
@@ -959,7 +6235,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 	while (1) {
 		editorSetStatusMessage(prompt, buf);
-		editorRefreshScreen();
+		if (!editorInputPending()) editorRefreshScreen();
 
 		int c = editorReadKey();
 		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -987,8 +6263,29 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 	}
 }
 
+static void wrapMove(int lines) {
+	// move the cursor up or down a number of visual lines, staying in the
+	// same column of the line. only the rows it passes get counted
+	int cols = E.screencols - E.gutter;
+	if (E.wrap.cols != cols) wrapReset();
+	erow *row = editorRowAt(E.cy);
+	int rx = row ? editorRowCxToRx(row, E.cx) : 0;
+	if (lines < 0) wrapRows(E.cy + lines, E.cy);
+	else wrapRows(E.cy, E.cy + lines);
+	int line = wrapLineAt(E.cy) + rx / cols + lines;
+	if (line < 0) line = 0;
+	int sub;
+	E.cy = wrapRowAt(line, &sub);
+	row = editorRowAt(E.cy);
+	E.cx = row ? editorRowRxToCx(row, sub * cols + rx % cols) : 0;
+}
+
 void editorMoveCursor(int key) {
-	erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	if (E.wrap.on && (key == ARROW_UP || key == ARROW_DOWN)) {
+		wrapMove(key == ARROW_UP ? -1 : 1);
+		return;
+	}
+	erow *row = editorRowAt(E.cy);
 	
 	switch(key) {
 	case ARROW_LEFT:
@@ -996,7 +6293,7 @@ void editorMoveCursor(int key) {
 			E.cx--;
 		} else if (E.cy > 0) {
 			E.cy--;
-			E.cx = E.row[E.cy].size;
+			E.cx = editorRowAt(E.cy)->size;
 		}
 		break;
 	case ARROW_RIGHT:
@@ -1018,7 +6315,7 @@ void editorMoveCursor(int key) {
 		}
 		break;
 	}
-	row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+	row = editorRowAt(E.cy);
 	int rowlen = row ? row->size : 0;
 	if (E.cx > rowlen) {
 		E.cx = rowlen;
@@ -1026,22 +6323,90 @@ void editorMoveCursor(int key) {
 	
 }
 
+void editorPaste(void) {
+	// gather everything up to the ESC[201~ that ends a bracketed paste and
+	// put it in as one block. if the end never turns up, whatever came
+	// before the read timed out goes in
+	static const char marker[] = "\x1b[201~";
+	int mlen = sizeof(marker) - 1;
+	struct abuf ab = ABUF_INIT;
+	while (1) {
+		if (IN.pos == IN.len && inputFill(KILO_INPUT_WAIT_MS) == 0) break;
+		char *p = IN.buf + IN.pos;
+		char *esc = memchr(p, '\x1b', IN.len - IN.pos);
+		if (esc == NULL) {
+			abAppend(&ab, p, IN.len - IN.pos);
+			IN.pos = IN.len;
+			continue;
+		}
+		abAppend(&ab, p, esc - p);
+		IN.pos = esc - IN.buf;
+		if (IN.len - IN.pos < mlen && inputFill(KILO_INPUT_WAIT_MS) == 0) break;
+		if (IN.len - IN.pos < mlen) continue;
+		if (memcmp(IN.buf + IN.pos, marker, mlen) == 0) {
+			IN.pos += mlen;
+			break;
+		}
+		abAppend(&ab, "\x1b", 1);
+		IN.pos++;
+	}
+	editorInsertText(ab.b, ab.len);
+	abFree(&ab);
+}
+
+static int editorTypedByte(int c) {
+	return c == '\t' || (c >= ' ' && c < 127);
+}
+
+void editorType(int c) {
+	// a typed key and the typing already waiting behind it go into the row
+	// in one insert, so a burst of keys is lexed and its comment state
+	// carried once and not once a key. the run stops where the undo log
+	// would start a new group, undo steps back just like key by key
+	if (!editorTypedByte(c) || E.cy == E.numrows) {
+		editorInsertChar(c);
+		return;
+	}
+	erow *row = editorRowAt(E.cy);
+	char run[KILO_UNDO_COALESCE];
+	int room = KILO_ROW_MAX - row->size;
+	int n = 0;
+	if (room > (int)sizeof(run)) room = sizeof(run);
+	if (room == 0) {
+		editorSetStatusMessage("Line is too long");
+		return;
+	}
+	run[n++] = c;
+	while (n < room && IN.pos < IN.len) {
+		unsigned char b = IN.buf[IN.pos];
+		if (!editorTypedByte(b) || (isspace(b) && !isspace((unsigned char)run[n - 1]))) break;
+		editorUndoKey(b);
+		run[n++] = b;
+		IN.pos++;
+	}
+	editorRowInsertString(row, E.cx, run, n);
+	E.cx += n;
+}
+
 void editorProcessKeypress(void) {
 	static int quit_times = KILO_QUIT_TIMES;
 	
 	int c = editorReadKey();
+	PROF_START(key);
+	editorUndoKey(c);
 
 	switch (c) {
 	case '\r':
 		editorInsertNewline();
 		break;
 	case CTRL_KEY('q'):
-		if (E.dirty && quit_times > 0) {
+		if (editorBuffersDirty() && quit_times > 0) {
 			editorSetStatusMessage("WARNING!!! File has unsaved changes. "
 														 "Press Ctrl-Q %d more times to quit.", quit_times);
 			quit_times--;
 			return;
 		}
+		editorBuffersDiscard();
 		write(STDOUT_FILENO, "\x1b[2J", 4); // clear screen & reset cursor
 		write(STDOUT_FILENO, "\x1b[H", 3);
 		exit(0);
@@ -1056,12 +6421,30 @@ void editorProcessKeypress(void) {
 		break;
 	case END_KEY:
 		if (E.cy < E.numrows) {
-			E.cx = E.row[E.cy].size;
+			E.cx = editorRowAt(E.cy)->size;
 		}
 		break;
 	case CTRL_KEY('f'):
 		editorFind();
 		break;
+	case CTRL_KEY('t'):
+		editorFollowToggle();
+		break;
+	case CTRL_KEY('w'):
+		editorWrapToggle();
+		break;
+	case CTRL_KEY('g'):
+		editorGoto();
+		break;
+	case CTRL_KEY('e'):
+		editorLineNumbersToggle();
+		break;
+	case CTRL_KEY('o'):
+		editorBufferPrompt();
+		break;
+	case CTRL_KEY('n'):
+		editorBufferNext();
+		break;
 	case BACKSPACE:
 	case CTRL_KEY('h'):
 	case DEL_KEY:
@@ -1071,7 +6454,12 @@ void editorProcessKeypress(void) {
 
 	case PAGE_UP:
   case PAGE_DOWN:
-    {
+    if (E.wrap.on) {
+      // a screenful of visual lines from the top or bottom of the screen
+      editorScroll();
+      if (c == PAGE_UP) wrapMove(-E.sy - E.screenrows);
+      else wrapMove(2 * E.screenrows - 1 - E.sy);
+    } else {
       if (c == PAGE_UP) {
         E.cy = E.rowoff;
       } else if (c == PAGE_DOWN) {
@@ -1092,14 +6480,36 @@ void editorProcessKeypress(void) {
 		break;
 
 	case CTRL_KEY('l'):
+		editorScreenInvalidate(); // draw everything again next time
+		break;
+
+	case CTRL_KEY('z'):
+		editorUndo();
+		break;
+#ifdef KILO_PROFILE
+	case CTRL_KEY('p'):
+		P.show = !P.show;
+		break;
+#endif
+	case CTRL_KEY('y'):
+		editorRedo();
+		break;
+
+	case PASTE_START:
+		editorPaste();
+		break;
+
 	case '\x1b':
+	case PASTE_END:
 		break;
 
 	default:
-		editorInsertChar(c);
+		editorType(c);
 		break;
 	}
+	editorUndoMark();
 	quit_times = KILO_QUIT_TIMES;
+	PROF_END(PROF_KEY, key);
 }
 
 /*** init ***/
@@ -1111,32 +6521,48 @@ void initEditor(void) {
 	E.rowoff = 0;
 	E.coloff = 0;
 	E.numrows = 0;
-	E.row = NULL;
+	E.rowtree = NULL;
 	E.dirty = 0;
 	E.filename = NULL;
+	E.map = NULL;
+	E.maplen = 0;
+	E.follow.fd = E.follow.ifd = -1;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 	E.syntax = NULL;
+	E.hl_frontier = 0;
+	E.hl_resume = 0;
 	
-	if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-	E.screenrows -= 2;
+	editorUpdateWindowSize();
 }
 
+#ifndef KILO_NO_MAIN
+// bench.c includes this file with KILO_NO_MAIN and brings its own
+
 int main(int argc, char *argv[]) {
 	enableRawMode(); // enable raw mode
 	initEditor();
+	editorWatchResize();
+#ifdef KILO_PROFILE
+	atexit(profDump);
+#endif
 
-	if (argc >= 2) {
-		editorOpen(argv[1]);
-	}
-	
+	for (int i = 1; i < argc; i++) editorBufferOpen(argv[i]);
+	if (B.len > 1) bufferSwitch(0);
 
-	editorSetStatusMessage("HELP: Ctrl-s = save | Ctrl-q = quit | Ctrl-f = find");
+	// a file that couldn't be opened keeps its message up instead
+	if (E.statusmsg[0] == '\0')
+		editorSetStatusMessage("HELP: Ctrl-s = save | Ctrl-q = quit | Ctrl-f = find | Ctrl-z/y = undo/redo");
 	
 	while (1) {
 		editorRefreshScreen();
-		editorProcessKeypress();
+		// handle every key that has already arrived before drawing again
+		do {
+			editorProcessKeypress();
+		} while (editorInputPending());
 	}
 
 	return 0;
 }
+
+#endif